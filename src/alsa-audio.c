@@ -34,9 +34,25 @@
 #include <sys/time.h>
 
 #include "audio.h"
+#include "log.h"
 
 
-static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
+/* Output device state, owned by the consumer thread */
+struct alsa_out {
+	snd_pcm_t *h;
+	int use_mmap;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+	int16_t *staging; /* batch buffer, rw access only */
+	unsigned int calls; /* snd_pcm_* calls while playing, not yet in dev_calls */
+};
+
+
+/*
+ * Opens the device for interleaved S16 output. Memory mapped access is
+ * preferred; out->use_mmap tells which one was granted.
+ */
+static snd_pcm_t *alsa_open(char *dev, int rate, int channels, struct alsa_out *out)
 {
 	snd_pcm_hw_params_t *hwp;
 	snd_pcm_sw_params_t *swp;
@@ -57,7 +73,11 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	memset(hwp, 0, snd_pcm_hw_params_sizeof());
 	snd_pcm_hw_params_any(h, hwp);
 
-	snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_RW_INTERLEAVED);
+	out->use_mmap = 1;
+	if (snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+		out->use_mmap = 0;
+		snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_RW_INTERLEAVED);
+	}
 	snd_pcm_hw_params_set_format(h, hwp, SND_PCM_FORMAT_S16_LE);
 	snd_pcm_hw_params_set_rate(h, hwp, rate, 0);
 	snd_pcm_hw_params_set_channels(h, hwp, channels);
@@ -75,8 +95,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_hw_params_set_period_size_near(h, hwp, &period_size, &dir);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to set period size %lu (%s)\n",
-		        period_size, snd_strerror(r));
+		log_error("audio: Unable to set period size %lu (%s)",
+		          period_size, snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -85,8 +105,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_hw_params_get_period_size(hwp, &period_size, &dir);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to get period size (%s)\n",
-		        snd_strerror(r));
+		log_error("audio: Unable to get period size (%s)",
+		          snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -101,8 +121,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_hw_params_set_buffer_size_near(h, hwp, &buffer_size);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to set buffer size %lu (%s)\n",
-		        buffer_size, snd_strerror(r));
+		log_error("audio: Unable to set buffer size %lu (%s)",
+		          buffer_size, snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -110,8 +130,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_hw_params_get_buffer_size(hwp, &buffer_size);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to get buffer size (%s)\n",
-		        snd_strerror(r));
+		log_error("audio: Unable to get buffer size (%s)",
+		          snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -120,8 +140,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_hw_params(h, hwp);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to configure hardware parameters (%s)\n",
-		        snd_strerror(r));
+		log_error("audio: Unable to configure hardware parameters (%s)",
+		          snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -137,8 +157,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_sw_params_set_avail_min(h, swp, period_size);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to configure wakeup threshold (%s)\n",
-		        snd_strerror(r));
+		log_error("audio: Unable to configure wakeup threshold (%s)",
+		          snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -146,8 +166,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	snd_pcm_sw_params_set_start_threshold(h, swp, 0);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Unable to configure start threshold (%s)\n",
-		        snd_strerror(r));
+		log_error("audio: Unable to configure start threshold (%s)",
+		          snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
@@ -155,7 +175,7 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	r = snd_pcm_sw_params(h, swp);
 
 	if (r < 0) {
-		fprintf(stderr, "audio: Cannot set soft parameters (%s)\n",
+		log_error("audio: Cannot set soft parameters (%s)",
 		snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
@@ -163,81 +183,200 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 
 	r = snd_pcm_prepare(h);
 	if (r < 0) {
-		fprintf(stderr, "audio: Cannot prepare audio for playback (%s)\n",
+		log_error("audio: Cannot prepare audio for playback (%s)",
 		snd_strerror(r));
 		snd_pcm_close(h);
 		return NULL;
 	}
 
+	out->period_size = period_size;
+	out->buffer_size = buffer_size;
 	return h;
 }
 
-static void* alsa_audio_start(void *aux)
+/*
+ * Hands up to frames frames to the device in one go: a single writei from
+ * the staging buffer, or mmap_begin/commit pairs filled directly from the
+ * chunks. Committing does not start the device the way writei does, so the
+ * mmap path starts it itself, after opening, a drop or an xrun.
+ */
+static int alsa_write_batch(struct alsa_out *out, audio_batch_t *b, snd_pcm_uframes_t frames)
 {
-	audio_fifo_t *af = aux;
-	snd_pcm_t *h = NULL;
-	int c;
-	int cur_channels = 0;
-	int cur_rate = 0;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset;
+	snd_pcm_uframes_t n;
+	snd_pcm_sframes_t r;
+	int filled;
+	int committed = 0;
+
+	if (!out->use_mmap) {
+		filled = audio_batch_fill(b, out->staging, frames);
+		out->calls++;
+		r = snd_pcm_writei(out->h, out->staging, filled);
+		return r < 0 ? r : 0;
+	}
+
+	while (frames > 0) {
+		n = frames;
+		out->calls += 2; /* begin and commit */
+		if ((r = snd_pcm_mmap_begin(out->h, &areas, &offset, &n)) < 0)
+			return r;
+
+		/* interleaved: a single area, first and step are in bits */
+		filled = audio_batch_fill(b, (int16_t *)((char *)areas[0].addr + areas[0].first / 8
+		                                         + offset * (areas[0].step / 8)), n);
 
-	audio_fifo_data_t *afd;
+		r = snd_pcm_mmap_commit(out->h, offset, filled);
+		if (r < 0)
+			return r;
+
+		committed += filled;
+		frames -= filled;
+		if (filled < n)
+			break; /* nothing more queued */
+	}
 
-	for (;;) {
-		afd = audio_get(af);
+	out->calls += committed > 0;
+	if (committed > 0 && snd_pcm_state(out->h) == SND_PCM_STATE_PREPARED) {
+		out->calls++;
+		if ((r = snd_pcm_start(out->h)) < 0)
+			return r;
+	}
+	return 0;
+}
+
+static int alsa_sink_open(audio_sink_t *s, int rate, int channels)
+{
+	struct alsa_out *out = calloc(1, sizeof(*out));
 
-		if (!h || cur_rate != afd->rate || cur_channels != afd->channels) {
-			if (h) snd_pcm_close(h);
+	out->h = alsa_open(s->arg ? s->arg : "default", rate, channels, out);
+	if (!out->h) {
+		free(out);
+		return -1;
+	}
+	out->staging = out->use_mmap ? NULL
+	                             : malloc(out->buffer_size * channels * sizeof(int16_t));
+	log_info("audio: %d channels, %d Hz, %s access, period %lu, buffer %lu",
+	         channels, rate, out->use_mmap ? "mmap" : "rw",
+	         (unsigned long)out->period_size, (unsigned long)out->buffer_size);
+	s->priv = out;
+	return 0;
+}
 
-			cur_rate = afd->rate;
-			cur_channels = afd->channels;
+/* alsa_sink_write() but for the counting */
+static snd_pcm_sframes_t alsa_sink_write_periods(struct alsa_out *out, audio_batch_t *b)
+{
+	snd_pcm_sframes_t c;
 
-			h = alsa_open("default", cur_rate, cur_channels);
+	out->calls++;
+	c = snd_pcm_wait(out->h, 1000);
+	__atomic_add_fetch(&b->af->dev_wakeups, 1, __ATOMIC_RELAXED);
 
-			if (!h) {
-				fprintf(stderr, "Unable to open ALSA device (%d channels, %d Hz), dying\n",
-				        cur_channels, cur_rate);
-				exit(1);
-			}
-		}
+	if (c >= 0) {
+		out->calls++;
+		c = snd_pcm_avail_update(out->h);
+	}
 
-		c = snd_pcm_wait(h, 1000);
+	if (c == -EPIPE) {
+		audio_fifo_stutter(b->af);
+		out->calls++;
+		snd_pcm_prepare(out->h);
+		c = out->buffer_size;
+	}
+	else if (c < 0) {
+		out->calls++;
+		snd_pcm_recover(out->h, c, 1);
+		return c;
+	}
 
-		if (c >= 0)
-			c = snd_pcm_avail_update(h);
+	/* whole periods when there is room for one */
+	if (c > out->buffer_size)
+		c = out->buffer_size;
+	if (c >= out->period_size)
+		c -= c % out->period_size;
+	if (c == 0)
+		return 0;
 
-		if (c == -EPIPE)
-			snd_pcm_prepare(h);
+	c = alsa_write_batch(out, b, c);
 
-		snd_pcm_writei(h, afd->samples, afd->nsamples);
-		free(afd);
+	if (c == -EPIPE) {
+		audio_fifo_stutter(b->af);
+		out->calls++;
+		snd_pcm_prepare(out->h);
 	}
+	return c;
 }
 
-void audio_init(audio_fifo_t *af)
+/*
+ * Waits for room for at least a period, then fills it with whole periods.
+ * The snd_pcm_* calls it takes, and the delay() call after the previous
+ * write, are counted in dev_calls.
+ */
+static int alsa_sink_write(audio_sink_t *s, audio_batch_t *b)
 {
-	pthread_t tid;
+	struct alsa_out *out = s->priv;
+	snd_pcm_sframes_t c;
 
-	TAILQ_INIT(&af->q);
-	af->qlen = 0;
+	c = alsa_sink_write_periods(out, b);
+	__atomic_add_fetch(&b->af->dev_calls, out->calls, __ATOMIC_RELAXED);
+	out->calls = 0;
+	return c;
+}
 
-	pthread_mutex_init(&af->mutex, NULL);
-	pthread_cond_init(&af->cond, NULL);
+static void alsa_sink_drain(audio_sink_t *s)
+{
+	struct alsa_out *out = s->priv;
+	snd_pcm_drain(out->h);
+}
 
-	pthread_create(&tid, NULL, alsa_audio_start, af);
+static void alsa_sink_drop(audio_sink_t *s)
+{
+	struct alsa_out *out = s->priv;
+	snd_pcm_drop(out->h);
+	snd_pcm_prepare(out->h);
 }
 
-void audio_fifo_flush(audio_fifo_t *af)
+static void alsa_sink_pause(audio_sink_t *s, int paused)
 {
-	audio_fifo_data_t *afd;
+	struct alsa_out *out = s->priv;
+
+	/* not every device can pause; stopping it is the next best thing */
+	if (snd_pcm_pause(out->h, paused) < 0) {
+		if (paused)
+			snd_pcm_drop(out->h);
+		else
+			snd_pcm_prepare(out->h);
+	}
+}
 
-	pthread_mutex_lock(&af->mutex);
+static int alsa_sink_delay(audio_sink_t *s)
+{
+	struct alsa_out *out = s->priv;
+	snd_pcm_sframes_t d;
 
-	while((afd = TAILQ_FIRST(&af->q))) {
-		TAILQ_REMOVE(&af->q, afd, link);
-		free(afd);
-	}
+	out->calls++;
+	if (snd_pcm_delay(out->h, &d) < 0 || d < 0)
+		return 0;
+	return d;
+}
+
+static void alsa_sink_close(audio_sink_t *s)
+{
+	struct alsa_out *out = s->priv;
 
-	af->qlen = 0;
-	pthread_mutex_unlock(&af->mutex);
+	snd_pcm_close(out->h);
+	free(out->staging);
+	free(out);
+	s->priv = NULL;
 }
 
+const audio_sink_ops_t audio_sink_alsa = {
+	.name = "alsa",
+	.open = alsa_sink_open,
+	.write = alsa_sink_write,
+	.drain = alsa_sink_drain,
+	.drop = alsa_sink_drop,
+	.pause = alsa_sink_pause,
+	.delay = alsa_sink_delay,
+	.close = alsa_sink_close,
+};
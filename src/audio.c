@@ -25,20 +25,630 @@
  * This file is part of the libspotify examples suite.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "audio.h"
+#include "log.h"
+#include "timeline.h"
 
-audio_fifo_data_t* audio_get(audio_fifo_t *af)
+#define AUDIO_FIFO_MASK (AUDIO_FIFO_SLOTS - 1)
+#define AUDIO_CHUNK_STRIDE \
+    ((sizeof(audio_fifo_data_t) + AUDIO_CHUNK_SAMPLES * sizeof(int16_t) \
+      + AUDIO_CACHELINE - 1) & ~(size_t)(AUDIO_CACHELINE - 1))
+
+#ifdef __linux__
+static void fifo_sleep(audio_fifo_t *af)
+{
+    syscall(SYS_futex, &af->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void fifo_wake(audio_fifo_t *af)
+{
+    syscall(SYS_futex, &af->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+static void fifo_sleep(audio_fifo_t *af)
 {
-    audio_fifo_data_t *afd;
     pthread_mutex_lock(&af->mutex);
-  
-    while (!(afd = TAILQ_FIRST(&af->q)))
+    while (__atomic_load_n(&af->sleeping, __ATOMIC_SEQ_CST))
 	pthread_cond_wait(&af->cond, &af->mutex);
-  
-    TAILQ_REMOVE(&af->q, afd, link);
-    af->qlen -= afd->nsamples;
-  
     pthread_mutex_unlock(&af->mutex);
+}
+
+static void fifo_wake(audio_fifo_t *af)
+{
+    pthread_mutex_lock(&af->mutex);
+    pthread_cond_signal(&af->cond);
+    pthread_mutex_unlock(&af->mutex);
+}
+#endif
+
+static void pool_init(audio_fifo_t *af)
+{
+    int i;
+
+    /* enough full chunks for twice the deepest buffer, at 44.1 kHz */
+    af->pool_chunks = 2 * (af->depth_max_ms * 44100 / 1000) / (AUDIO_CHUNK_SAMPLES / 2) + 1;
+    if (af->pool_chunks < AUDIO_POOL_CHUNKS)
+	af->pool_chunks = AUDIO_POOL_CHUNKS;
+    if (af->pool_chunks > AUDIO_FIFO_SLOTS)
+	af->pool_chunks = AUDIO_FIFO_SLOTS;
+
+    if (posix_memalign(&af->pool_mem, AUDIO_CACHELINE,
+                       af->pool_chunks * AUDIO_CHUNK_STRIDE)) {
+	log_error("audio: Unable to allocate chunk pool, dying");
+	exit(1);
+    }
+
+    af->pool_free = NULL;
+    for (i = af->pool_chunks - 1; i >= 0; i--) {
+	audio_fifo_data_t *afd = (audio_fifo_data_t *)((char *)af->pool_mem + i * AUDIO_CHUNK_STRIDE);
+	afd->next = af->pool_free;
+	af->pool_free = afd;
+    }
+    af->pool_avail = af->pool_min_avail = af->pool_chunks;
+    af->pool_exhausted = 0;
+}
+
+/*
+ * Producer side. Returns NULL when every chunk is in flight.
+ */
+audio_fifo_data_t* audio_chunk_alloc(audio_fifo_t *af)
+{
+    audio_fifo_data_t *afd = __atomic_load_n(&af->pool_free, __ATOMIC_ACQUIRE);
+    int avail;
+
+    while (afd && !__atomic_compare_exchange_n(&af->pool_free, &afd, afd->next, 1,
+                                               __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+	;
+
+    if (!afd) {
+	__atomic_add_fetch(&af->pool_exhausted, 1, __ATOMIC_RELAXED);
+	return NULL;
+    }
+
+    avail = __atomic_sub_fetch(&af->pool_avail, 1, __ATOMIC_RELAXED);
+    if (avail < af->pool_min_avail)
+	af->pool_min_avail = avail;
+    return afd;
+}
+
+void audio_chunk_free(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+    audio_fifo_data_t *top = __atomic_load_n(&af->pool_free, __ATOMIC_RELAXED);
+
+    do {
+	afd->next = top;
+    } while (!__atomic_compare_exchange_n(&af->pool_free, &top, afd, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&af->pool_avail, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Optional; must come before audio_init(). Out of range values are clamped.
+ */
+void audio_fifo_set_depth(audio_fifo_t *af, int min_ms, int target_ms, int max_ms)
+{
+    if (max_ms > AUDIO_DEPTH_LIMIT_MS)
+	max_ms = AUDIO_DEPTH_LIMIT_MS;
+    if (min_ms < 50)
+	min_ms = 50;
+    if (min_ms > max_ms)
+	min_ms = max_ms;
+    if (target_ms < min_ms)
+	target_ms = min_ms;
+    if (target_ms > max_ms)
+	target_ms = max_ms;
+
+    af->depth_min_ms = min_ms;
+    af->depth_target_ms = target_ms;
+    af->depth_max_ms = max_ms;
+}
+
+/*
+ * How many frames the producer may keep queued at the given rate.
+ */
+int audio_fifo_depth_frames(audio_fifo_t *af, int rate)
+{
+    return (int)((int64_t)__atomic_load_n(&af->depth_target_ms, __ATOMIC_RELAXED) * rate / 1000);
+}
+
+static void depth_grow(audio_fifo_t *af)
+{
+    int target = af->depth_target_ms;
+    int step = target / 2 > 100 ? target / 2 : 100;
+
+    af->stable_frames = 0;
+    if (target >= af->depth_max_ms)
+	return;
+    target = target + step < af->depth_max_ms ? target + step : af->depth_max_ms;
+    __atomic_store_n(&af->depth_target_ms, target, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->depth_grows, 1, __ATOMIC_RELAXED);
+}
+
+static void depth_maybe_shrink(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+    int target = af->depth_target_ms;
+    int step = target / 10 > 50 ? target / 10 : 50;
+
+    af->stable_frames += afd->nsamples;
+    if (af->stable_frames < afd->rate * AUDIO_DEPTH_SHRINK_AFTER_S)
+	return;
+    af->stable_frames = 0;
+    if (target <= af->depth_min_ms)
+	return;
+    target = target - step > af->depth_min_ms ? target - step : af->depth_min_ms;
+    __atomic_store_n(&af->depth_target_ms, target, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->depth_shrinks, 1, __ATOMIC_RELAXED);
+}
+
+static int lat_bucket(uint64_t us)
+{
+    int e = 0;
+
+    if (us < 8)
+	return us;
+    while (us >> (e + 1))
+	e++;
+    if (e > 33)
+	return AUDIO_LAT_BUCKETS - 1;
+    return (e - 2) * 8 + ((us >> (e - 3)) & 7);
+}
+
+/* highest latency that falls in bucket b */
+static uint64_t lat_bucket_max(int b)
+{
+    int e = b / 8 + 2;
+
+    if (b < 8)
+	return b;
+    return ((uint64_t)(8 + b % 8 + 1) << (e - 3)) - 1;
+}
+
+/*
+ * Bookkeeping for every chunk audio_get()/audio_try_get() hands out.
+ */
+static void chunk_dequeued(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+    uint64_t now = now_ns();
+
+    __atomic_add_fetch(&af->lat_hist[lat_bucket((now - afd->put_ns) / 1000)], 1,
+                       __ATOMIC_RELAXED);
+    if (!af->first_get_ns)
+	__atomic_store_n(&af->first_get_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&af->last_get_ns, now, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->frames_out, afd->nsamples, __ATOMIC_RELAXED);
+    depth_maybe_shrink(af, afd);
+}
+
+/*
+ * Queueing latency below which the given fraction of chunks fell, rounded
+ * up to the histogram's resolution (1/8th of a power of two).
+ */
+int audio_fifo_latency_us(audio_fifo_t *af, double quantile)
+{
+    uint64_t total = 0, seen = 0;
+    int b;
+
+    for (b = 0; b < AUDIO_LAT_BUCKETS; b++)
+	total += __atomic_load_n(&af->lat_hist[b], __ATOMIC_RELAXED);
+    if (!total)
+	return 0;
+    for (b = 0; b < AUDIO_LAT_BUCKETS; b++) {
+	seen += __atomic_load_n(&af->lat_hist[b], __ATOMIC_RELAXED);
+	if (seen >= quantile * total)
+	    break;
+    }
+    return lat_bucket_max(b < AUDIO_LAT_BUCKETS ? b : AUDIO_LAT_BUCKETS - 1);
+}
+
+/*
+ * Frames per second handed out between the first and the last chunk; only
+ * meaningful when something other than the device sets the pace.
+ */
+double audio_fifo_throughput(audio_fifo_t *af)
+{
+    uint64_t first = __atomic_load_n(&af->first_get_ns, __ATOMIC_RELAXED);
+    uint64_t last = __atomic_load_n(&af->last_get_ns, __ATOMIC_RELAXED);
+
+    if (last <= first)
+	return 0;
+    return __atomic_load_n(&af->frames_out, __ATOMIC_RELAXED) * 1e9 / (last - first);
+}
+
+void audio_fifo_init(audio_fifo_t *af)
+{
+    if (0 == af->depth_max_ms)
+	audio_fifo_set_depth(af, AUDIO_DEPTH_MIN_MS, AUDIO_DEPTH_TARGET_MS, AUDIO_DEPTH_MAX_MS);
+    af->depth_grows = af->depth_shrinks = 0;
+    af->stable_frames = 0;
+    pool_init(af);
+    af->head = af->tail = 0;
+    af->qlen = 0;
+    af->sleeping = 0;
+    af->generation = af->seen_generation = 0;
+    af->paused = af->seen_paused = 0;
+    af->quit = 0;
+    af->dev_delay = 0;
+    af->skip_pending = 0;
+    af->flush_ns = 0;
+    af->skips = af->stale_chunks = 0;
+    af->skip_ns_last = af->skip_ns_max = 0;
+    af->stutters = af->empty_waits = 0;
+    af->dev_wakeups = af->dev_writes = af->dev_calls = 0;
+    af->dev_audio_us = 0;
+#ifndef __linux__
+    pthread_mutex_init(&af->mutex, NULL);
+    pthread_cond_init(&af->cond, NULL);
+#endif
+}
+
+int audio_fifo_qlen(audio_fifo_t *af)
+{
+    return __atomic_load_n(&af->qlen, __ATOMIC_RELAXED);
+}
+
+/*
+ * The producer tags each chunk with this; chunks from an older generation
+ * are dropped by the consumer.
+ */
+unsigned int audio_fifo_generation(audio_fifo_t *af)
+{
+    return __atomic_load_n(&af->generation, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called by the backends, from the consumer thread, when the output device
+ * underran.
+ */
+void audio_fifo_stutter(audio_fifo_t *af)
+{
+    __atomic_add_fetch(&af->stutters, 1, __ATOMIC_RELAXED);
+    depth_grow(af);
+}
+
+/*
+ * Producer side. Returns 0 when the ring is full, in which case the caller
+ * keeps ownership of afd.
+ */
+int audio_put(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+    unsigned int tail = af->tail;
+
+    if (tail - __atomic_load_n(&af->head, __ATOMIC_ACQUIRE) == AUDIO_FIFO_SLOTS)
+	return 0;
+
+    afd->put_ns = now_ns();
+    af->slots[tail & AUDIO_FIFO_MASK] = afd;
+    __atomic_add_fetch(&af->qlen, afd->nsamples, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->frames_in, afd->nsamples, __ATOMIC_RELAXED);
+    __atomic_store_n(&af->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_exchange_n(&af->sleeping, 0, __ATOMIC_SEQ_CST))
+	fifo_wake(af);
+    return 1;
+}
+
+/*
+ * Drops everything queued so far, and whatever the producer queues before it
+ * notices the new generation. Only the consumer touches the slots, so this
+ * is carried out by audio_get(), which first returns NULL to let the backend
+ * drop what the device still holds.
+ */
+void audio_fifo_flush(audio_fifo_t *af)
+{
+    __atomic_store_n(&af->flush_ns, now_ns(), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->generation, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&af->sleeping, 0, __ATOMIC_SEQ_CST))
+	fifo_wake(af);
+}
+
+/*
+ * While paused the consumer hands nothing to the sink, which gets paused
+ * too, so that what is buffered survives.
+ */
+void audio_fifo_pause(audio_fifo_t *af, int paused)
+{
+    __atomic_store_n(&af->paused, !!paused, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&af->sleeping, 0, __ATOMIC_SEQ_CST))
+	fifo_wake(af);
+}
+
+static void skip_done(audio_fifo_t *af)
+{
+    uint64_t ns = now_ns() - __atomic_load_n(&af->flush_ns, __ATOMIC_RELAXED);
+
+    af->skip_pending = 0;
+    __atomic_store_n(&af->skip_ns_last, ns, __ATOMIC_RELAXED);
+    if (ns > af->skip_ns_max)
+	__atomic_store_n(&af->skip_ns_max, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->skip_ns_sum, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&af->skips, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Consumer side, for topping up a batch. Returns NULL when nothing is queued
+ * or when a flush is pending, which the next audio_get() reports.
+ */
+audio_fifo_data_t* audio_try_get(audio_fifo_t *af)
+{
+    audio_fifo_data_t *afd;
+    unsigned int head = af->head;
+    unsigned int gen = __atomic_load_n(&af->generation, __ATOMIC_ACQUIRE);
+
+    if (gen != af->seen_generation
+	|| __atomic_load_n(&af->paused, __ATOMIC_ACQUIRE) != af->seen_paused
+	|| af->seen_paused)
+	return NULL;
+
+    while (__atomic_load_n(&af->tail, __ATOMIC_ACQUIRE) != head) {
+	afd = af->slots[head & AUDIO_FIFO_MASK];
+	__atomic_store_n(&af->head, ++head, __ATOMIC_RELEASE);
+	__atomic_sub_fetch(&af->qlen, afd->nsamples, __ATOMIC_RELAXED);
+	if (afd->generation == gen) {
+	    chunk_dequeued(af, afd);
+	    return afd;
+	}
+	__atomic_add_fetch(&af->stale_chunks, 1, __ATOMIC_RELAXED);
+	audio_chunk_free(af, afd);
+    }
+    return NULL;
+}
+
+/*
+ * Consumer side. Blocks until a chunk is available; returns NULL once after
+ * each audio_fifo_flush() and each pause or resume, and for good once
+ * audio_stop() was called.
+ */
+audio_fifo_data_t* audio_get(audio_fifo_t *af)
+{
+    audio_fifo_data_t *afd;
+    unsigned int head = af->head;
+    unsigned int gen;
+    int paused;
+
+    for (;;) {
+	if (__atomic_load_n(&af->quit, __ATOMIC_ACQUIRE))
+	    return NULL;
+	gen = __atomic_load_n(&af->generation, __ATOMIC_ACQUIRE);
+	if (gen != af->seen_generation) {
+	    af->seen_generation = gen;
+	    af->skip_pending = 1;
+	    return NULL;
+	}
+	paused = __atomic_load_n(&af->paused, __ATOMIC_ACQUIRE);
+	if (paused != af->seen_paused) {
+	    af->seen_paused = paused;
+	    return NULL;
+	}
+
+	if (!paused && __atomic_load_n(&af->tail, __ATOMIC_ACQUIRE) != head) {
+	    afd = af->slots[head & AUDIO_FIFO_MASK];
+	    __atomic_store_n(&af->head, ++head, __ATOMIC_RELEASE);
+	    __atomic_sub_fetch(&af->qlen, afd->nsamples, __ATOMIC_RELAXED);
+	    if (afd->generation == gen)
+		break;
+	    __atomic_add_fetch(&af->stale_chunks, 1, __ATOMIC_RELAXED);
+	    audio_chunk_free(af, afd);
+	    continue;
+	}
+
+	/* about to cross empty: announce it, then check again before sleeping */
+	__atomic_store_n(&af->sleeping, 1, __ATOMIC_SEQ_CST);
+	if ((!paused && __atomic_load_n(&af->tail, __ATOMIC_SEQ_CST) != head)
+	    || __atomic_load_n(&af->generation, __ATOMIC_SEQ_CST) != gen
+	    || __atomic_load_n(&af->paused, __ATOMIC_SEQ_CST) != paused
+	    || __atomic_load_n(&af->quit, __ATOMIC_SEQ_CST)) {
+	    __atomic_store_n(&af->sleeping, 0, __ATOMIC_RELAXED);
+	    continue;
+	}
+	__atomic_add_fetch(&af->empty_waits, 1, __ATOMIC_RELAXED);
+	fifo_sleep(af);
+    }
+
+    chunk_dequeued(af, afd);
     return afd;
 }
 
+/*
+ * Copies up to frames frames to dst, or just consumes them when dst is
+ * NULL. Stops early when the FIFO runs dry or the format changes, and never
+ * blocks.
+ */
+int audio_batch_fill(audio_batch_t *b, int16_t *dst, int frames)
+{
+    int filled = 0;
+    int n;
+
+    while (filled < frames) {
+	if (!b->cur) {
+	    b->cur = audio_try_get(b->af);
+	    b->cur_off = 0;
+	    if (!b->cur)
+		break;
+	}
+	if (b->cur->rate != b->rate || b->cur->channels != b->channels)
+	    break; /* the sink gets reopened first */
+
+	n = b->cur->nsamples - b->cur_off;
+	if (n > frames - filled)
+	    n = frames - filled;
+	if (dst)
+	    memcpy(dst + filled * b->channels, b->cur->samples + b->cur_off * b->channels,
+	           n * b->channels * sizeof(int16_t));
+	filled += n;
+	b->cur_off += n;
+
+	if (b->cur_off == b->cur->nsamples) {
+	    audio_chunk_free(b->af, b->cur);
+	    b->cur = NULL;
+	}
+    }
+    __atomic_add_fetch(&b->af->dev_audio_us, (uint64_t)filled * 1000000 / b->rate,
+                       __ATOMIC_RELAXED);
+    return filled;
+}
+
+/*
+ * The audio thread: moves chunks from the FIFO to the sink, and forwards
+ * flushes, pauses and format changes to it, until audio_stop().
+ */
+static void* audio_consumer(void *aux)
+{
+    audio_fifo_t *af = aux;
+    audio_sink_t *sink = af->sink;
+    audio_batch_t b;
+    unsigned int gen = 0;
+    int opened = 0;
+    int paused = 0;
+
+    memset(&b, 0, sizeof(b));
+    b.af = af;
+
+    for (;;) {
+	/* a flush also invalidates the chunk in progress */
+	if (b.cur && b.cur->generation != audio_fifo_generation(af)) {
+	    audio_chunk_free(af, b.cur);
+	    b.cur = NULL;
+	}
+
+	if (!b.cur) {
+	    b.cur = audio_get(af);
+	    b.cur_off = 0;
+
+	    if (!b.cur) {
+		if (__atomic_load_n(&af->quit, __ATOMIC_ACQUIRE))
+		    break;
+		if (opened && af->seen_generation != gen)
+		    sink->ops->drop(sink);
+		if (opened && af->seen_paused != paused)
+		    sink->ops->pause(sink, af->seen_paused);
+		gen = af->seen_generation;
+		paused = af->seen_paused;
+		continue;
+	    }
+	}
+
+	/*
+	 * The sink stays open across tracks; it is only reopened when the
+	 * format changes, after playing out what it holds.
+	 */
+	if (!opened || b.rate != b.cur->rate || b.channels != b.cur->channels) {
+	    if (opened) {
+		sink->ops->drain(sink);
+		sink->ops->close(sink);
+	    }
+	    b.rate = b.cur->rate;
+	    b.channels = b.cur->channels;
+	    if (sink->ops->open(sink, b.rate, b.channels)) {
+		log_error("Unable to open %s audio output (%d channels, %d Hz), dying",
+		          sink->ops->name, b.channels, b.rate);
+		exit(1);
+	    }
+	    opened = 1;
+	    __atomic_add_fetch(&af->dev_opens, 1, __ATOMIC_RELAXED);
+	}
+
+	sink->ops->write(sink, &b);
+	timeline_mark(TIMELINE_FIRST_WRITE);
+	/* the skip is over once the new track reached the device */
+	if (af->skip_pending)
+	    skip_done(af);
+	__atomic_add_fetch(&af->dev_writes, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&af->dev_delay, sink->ops->delay(sink), __ATOMIC_RELAXED);
+    }
+
+    if (b.cur)
+	audio_chunk_free(af, b.cur);
+    if (opened) {
+	sink->ops->drop(sink);
+	sink->ops->close(sink);
+    }
+    return NULL;
+}
+
+void audio_init(audio_fifo_t *af, audio_sink_t *sink)
+{
+    audio_fifo_init(af);
+    af->sink = sink;
+
+    pthread_create(&af->thread, NULL, audio_consumer, af);
+}
+
+/*
+ * Stops the audio thread, which drops and closes the sink, then frees the
+ * sink and the pool. Nothing may be delivered any more: the producer has to
+ * be stopped first.
+ */
+void audio_stop(audio_fifo_t *af)
+{
+    __atomic_store_n(&af->quit, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&af->sleeping, 0, __ATOMIC_SEQ_CST))
+	fifo_wake(af);
+    pthread_join(af->thread, NULL);
+
+    free(af->sink->arg);
+    free(af->sink);
+    af->sink = NULL;
+    free(af->pool_mem);
+    af->pool_mem = NULL;
+#ifndef __linux__
+    pthread_cond_destroy(&af->cond);
+    pthread_mutex_destroy(&af->mutex);
+#endif
+}
+
+static const audio_sink_ops_t *sinks[] = {
+#ifdef HAVE_ALSA
+    &audio_sink_alsa,
+#endif
+#ifdef HAVE_AUDIOQUEUE
+    &audio_sink_osx,
+#endif
+    &audio_sink_null,
+    &audio_sink_wav,
+    NULL
+};
+
+const char* audio_sink_name(int i)
+{
+    return sinks[i] ? sinks[i]->name : NULL;
+}
+
+/*
+ * Looks up a sink from a name[:arg] spec; NULL picks the first one built in.
+ */
+audio_sink_t* audio_sink_new(const char *spec)
+{
+    const audio_sink_ops_t **ops = sinks;
+    const char *colon = spec ? strchr(spec, ':') : NULL;
+    size_t len = colon ? (size_t)(colon - spec) : (spec ? strlen(spec) : 0);
+    audio_sink_t *sink;
+
+    if (spec)
+	for (; *ops; ops++)
+	    if (strlen((*ops)->name) == len && !strncmp((*ops)->name, spec, len))
+		break;
+    if (!*ops)
+	return NULL;
+
+    sink = calloc(1, sizeof(*sink));
+    sink->ops = *ops;
+    sink->arg = colon ? strdup(colon + 1) : NULL;
+    return sink;
+}
@@ -29,29 +29,185 @@
 
 #include <pthread.h>
 #include <stdint.h>
-#include "queue.h"
+
+
+/* --- Definitions --- */
+#define AUDIO_FIFO_SLOTS 256 /* must be a power of two */
+#define AUDIO_CACHELINE 64
+#define AUDIO_POOL_CHUNKS 64 /* at least; grows with the maximum depth */
+#define AUDIO_CHUNK_SAMPLES (2048 * 2) /* 2048 stereo frames */
+
+/* jitter buffer defaults and limits, in milliseconds of audio */
+#define AUDIO_DEPTH_MIN_MS 500
+#define AUDIO_DEPTH_TARGET_MS 1000
+#define AUDIO_DEPTH_MAX_MS 3000
+#define AUDIO_DEPTH_LIMIT_MS 5000
+#define AUDIO_DEPTH_SHRINK_AFTER_S 30 /* of stutter-free playback */
+
+#define AUDIO_LAT_BUCKETS 256 /* 8 per power of two of microseconds */
 
 
 /* --- Types --- */
 typedef struct audio_fifo_data {
-	TAILQ_ENTRY(audio_fifo_data) link;
+	struct audio_fifo_data *next; /* pool freelist link */
+	uint64_t put_ns; /* when audio_put() queued it */
+	unsigned int generation; /* audio_fifo_t generation it was queued in */
 	int channels;
 	int rate;
 	int nsamples;
 	int16_t samples[0];
 } audio_fifo_data_t;
 
+/*
+ * Single producer (music_delivery) / single consumer (audio thread) ring of
+ * chunks. Neither side ever takes a lock on the fast path; the consumer only
+ * sleeps, and the producer only wakes it, when the ring crosses empty.
+ */
 typedef struct audio_fifo {
-	TAILQ_HEAD(, audio_fifo_data) q;
-	int qlen;
+	/* written by the producer only */
+	unsigned int tail __attribute__((aligned(AUDIO_CACHELINE)));
+	unsigned int put_rejects; /* deliveries turned down, counted by the caller */
+	uint64_t frames_in;
+
+	/* written by the consumer only */
+	unsigned int head __attribute__((aligned(AUDIO_CACHELINE)));
+	unsigned int seen_generation;
+	int seen_paused;
+	int skip_pending;
+
+	/* shared */
+	int qlen __attribute__((aligned(AUDIO_CACHELINE)));
+	int sleeping;
+	unsigned int generation; /* bumped by audio_fifo_flush() */
+	int paused;
+	int quit; /* set by audio_stop() */
+	uint64_t flush_ns;
+
+	/* flush to first chunk of the new generation handed to the device */
+	unsigned int skips;
+	uint64_t skip_ns_last;
+	uint64_t skip_ns_max;
+	uint64_t skip_ns_sum;
+	unsigned int stale_chunks;
+
+	/* underrun accounting, read by get_audio_buffer_stats and status */
+	unsigned int stutters;    /* device ran dry (ALSA xrun) */
+	unsigned int empty_waits; /* consumer found the ring empty */
+
+	/*
+	 * Jitter buffer depth the producer fills up to. Grown by the consumer
+	 * after each stutter, shrunk back slowly while playback is stable.
+	 */
+	int depth_min_ms;
+	int depth_max_ms;
+	int depth_target_ms;
+	unsigned int depth_grows;
+	unsigned int depth_shrinks;
+	int stable_frames; /* consumer only */
+
+	/* output device activity */
+	unsigned int dev_wakeups; /* maintained by the sinks that wait */
+	unsigned int dev_writes;
+	unsigned int dev_calls; /* to the device library, by the sinks that count them */
+	unsigned int dev_opens;
+	uint64_t dev_audio_us; /* audio handed to the device */
+	int dev_delay;         /* frames queued in the device, as of the last write */
+
+	/* audio_put() to audio_get() handing the chunk out, consumer only */
+	unsigned int lat_hist[AUDIO_LAT_BUCKETS];
+	uint64_t frames_out;
+	uint64_t first_get_ns;
+	uint64_t last_get_ns;
+
+	struct audio_sink *sink;
+	pthread_t thread;
+#ifndef __linux__
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+#endif
+
+	audio_fifo_data_t *slots[AUDIO_FIFO_SLOTS] __attribute__((aligned(AUDIO_CACHELINE)));
+
+	/*
+	 * Preallocated chunks. The producer is the only thread popping from the
+	 * freelist, which keeps the lock-free stack safe from ABA.
+	 */
+	audio_fifo_data_t *pool_free __attribute__((aligned(AUDIO_CACHELINE)));
+	int pool_chunks;
+	int pool_avail;
+	int pool_min_avail;
+	unsigned int pool_exhausted;
+	void *pool_mem;
 } audio_fifo_t;
 
 
+/*
+ * What a sink's write() pulls frames from: the chunk in progress, then
+ * whatever else the FIFO holds in the same format.
+ */
+typedef struct audio_batch {
+	audio_fifo_t *af;
+	audio_fifo_data_t *cur;
+	int cur_off; /* frames of cur already consumed */
+	int rate;
+	int channels;
+} audio_batch_t;
+
+typedef struct audio_sink audio_sink_t;
+
+/*
+ * Output backend. All calls are made from the audio consumer thread, with
+ * open() first and close() last; a format change closes and reopens.
+ * write() takes as many frames from the batch as the sink wants, at least
+ * one, blocking on the device as needed.
+ */
+typedef struct audio_sink_ops {
+	const char *name;
+	int (*open)(audio_sink_t *s, int rate, int channels);
+	int (*write)(audio_sink_t *s, audio_batch_t *b);
+	void (*drain)(audio_sink_t *s);
+	void (*drop)(audio_sink_t *s);
+	void (*pause)(audio_sink_t *s, int paused);
+	int (*delay)(audio_sink_t *s);
+	void (*close)(audio_sink_t *s);
+} audio_sink_ops_t;
+
+struct audio_sink {
+	const audio_sink_ops_t *ops;
+	char *arg;  /* what follows the colon in name:arg, or NULL */
+	void *priv; /* owned by the backend between open() and close() */
+};
+
+extern const audio_sink_ops_t audio_sink_null;
+extern const audio_sink_ops_t audio_sink_wav;
+#ifdef HAVE_ALSA
+extern const audio_sink_ops_t audio_sink_alsa;
+#endif
+#ifdef HAVE_AUDIOQUEUE
+extern const audio_sink_ops_t audio_sink_osx;
+#endif
+
+
 /* --- Functions --- */
-extern void audio_init(audio_fifo_t *af);
-extern void audio_fifo_flush(audio_fifo_t *af);
+void audio_init(audio_fifo_t *af, audio_sink_t *sink);
+void audio_stop(audio_fifo_t *af);
+audio_sink_t* audio_sink_new(const char *spec);
+const char* audio_sink_name(int i);
+int audio_batch_fill(audio_batch_t *b, int16_t *dst, int frames);
+void audio_fifo_init(audio_fifo_t *af);
+void audio_fifo_pause(audio_fifo_t *af, int paused);
+void audio_fifo_set_depth(audio_fifo_t *af, int min_ms, int target_ms, int max_ms);
+int audio_fifo_depth_frames(audio_fifo_t *af, int rate);
+void audio_fifo_flush(audio_fifo_t *af);
+int audio_fifo_qlen(audio_fifo_t *af);
+int audio_fifo_latency_us(audio_fifo_t *af, double quantile);
+double audio_fifo_throughput(audio_fifo_t *af);
+void audio_fifo_stutter(audio_fifo_t *af);
+unsigned int audio_fifo_generation(audio_fifo_t *af);
+audio_fifo_data_t* audio_chunk_alloc(audio_fifo_t *af);
+void audio_chunk_free(audio_fifo_t *af, audio_fifo_data_t *afd);
+int audio_put(audio_fifo_t *af, audio_fifo_data_t *afd);
 audio_fifo_data_t* audio_get(audio_fifo_t *af);
+audio_fifo_data_t* audio_try_get(audio_fifo_t *af);
 
 #endif /* _JUKEBOX_AUDIO_H_ */
@@ -0,0 +1,859 @@
+/*
+ * Offline stand-in for the part of libspotify spotify_cmd uses, so that
+ * tracklist loading, skipping and the audio path can be run without an
+ * account or a network (./configure fake).
+ *
+ * Understood uris, every other one fails to parse:
+ *   spotify:track:<id>            a single track
+ *   spotify:album:<id>            an album of FAKE_SPOTIFY_ALBUM_TRACKS tracks
+ *   spotify:user:<user>:playlist:<id>, spotify:playlist:<id>
+ *                                 a playlist of FAKE_SPOTIFY_PLAYLIST_TRACKS
+ * A track id starting with "unavailable" is reported as such, one starting
+ * with "unplayable" is available but fails to load into the player.
+ *
+ * Any username and password log in, and get a credentials blob back; logging
+ * in with the blob takes a quarter of the usual delay.
+ *
+ * Knobs, read from the environment when the session is created:
+ *   FAKE_SPOTIFY_DELAY_MS   time for login and for anything to load (100)
+ *   FAKE_SPOTIFY_TRACK_MS   duration of every track (180000)
+ *   FAKE_SPOTIFY_SPEED      audio delivery rate, in times real time (1);
+ *                           0 delivers as fast as music_delivery takes it
+ *   FAKE_SPOTIFY_CHUNK_FRAMES  frames offered per music_delivery call (2048)
+ *   FAKE_SPOTIFY_LOAD_BATCH  playlist tracks loaded per metadata_updated
+ *                           callback; 0 loads them all at once (0)
+ *
+ * As with the real library, callbacks run from sp_session_process_events,
+ * except music_delivery and end_of_track which come from the player thread.
+ */
+
+#include <libspotify/api.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+#define FAKE_RATE 44100
+#define FAKE_CHANNELS 2
+#define FAKE_NAME_LEN 128
+
+
+struct sp_artist {
+	char name[FAKE_NAME_LEN];
+};
+
+struct sp_album {
+	int refs;
+	char name[FAKE_NAME_LEN];
+	struct sp_artist artist;
+};
+
+struct sp_track {
+	int refs;
+	int loaded;
+	int available;
+	int playable;
+	int duration;
+	char name[FAKE_NAME_LEN];
+	sp_album *album;
+};
+
+struct sp_albumbrowse {
+	int refs;
+	int loaded;
+	sp_album *album;
+	sp_track **tracks;
+	int ntracks;
+	albumbrowse_complete_cb *cb;
+	void *userdata;
+};
+
+struct fake_playlist_cb {
+	sp_playlist_callbacks *callbacks;
+	void *userdata;
+};
+
+struct sp_playlist {
+	int refs;
+	int loaded;
+	sp_track **tracks;
+	int ntracks;
+	int nloaded;
+	struct fake_playlist_cb *cbs;
+	int ncbs;
+};
+
+struct sp_link {
+	sp_linktype type;
+	sp_track *track;
+	sp_album *album;
+	char id[FAKE_NAME_LEN];
+};
+
+/* something for sp_session_process_events to do once due */
+struct fake_event {
+	uint64_t due_ns;
+	void (*run)(sp_session *session, void *arg);
+	void *arg;
+	struct fake_event *next;
+};
+
+struct sp_session {
+	sp_session_callbacks callbacks;
+	void *userdata;
+
+	int delay_ms;
+	int track_ms;
+	int album_tracks;
+	int playlist_tracks;
+	int chunk_frames;
+	int load_batch;
+	double speed;
+
+	struct fake_event *events;	/* sorted by due_ns, main thread only */
+	char username[FAKE_NAME_LEN];
+	int remember_me;
+
+	/* player, shared with the player thread */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	sp_track *track;
+	int playing;
+	int64_t pos;			/* frames delivered of the loaded track */
+	uint64_t pace_start_ns;
+	int64_t pace_frames;		/* frames delivered since pace_start_ns */
+	int16_t *buf;
+};
+
+/*
+ * sp_link_as_track has no session argument: it uses the session last created
+ * by the calling thread, which is the one the caller processes events of.
+ */
+static __thread sp_session *fake_session;
+
+/* no application key is needed, configure leaves spotify_appkey.c out */
+const unsigned char g_appkey[] = { 0 };
+const size_t g_appkey_size = 0;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int env_int(const char *name, int dflt)
+{
+	const char *v = getenv(name);
+	return v ? atoi(v) : dflt;
+}
+
+static void schedule(sp_session *session, int delay_ms,
+		     void (*run)(sp_session *, void *), void *arg)
+{
+	struct fake_event *ev = malloc(sizeof(*ev));
+	struct fake_event **p = &session->events;
+
+	ev->due_ns = now_ns() + (uint64_t)delay_ms * 1000000;
+	ev->run = run;
+	ev->arg = arg;
+	while (*p && (*p)->due_ns <= ev->due_ns)
+		p = &(*p)->next;
+	ev->next = *p;
+	*p = ev;
+
+	if (session->callbacks.notify_main_thread)
+		session->callbacks.notify_main_thread(session);
+}
+
+
+/* --- Metadata objects --- */
+
+static sp_album *album_new(const char *id)
+{
+	sp_album *album = calloc(1, sizeof(*album));
+
+	album->refs = 1;
+	snprintf(album->name, sizeof(album->name), "Album %.64s", id);
+	snprintf(album->artist.name, sizeof(album->artist.name), "Artist %.64s", id);
+	return album;
+}
+
+static sp_track *track_new(sp_session *session, const char *name, sp_album *album)
+{
+	sp_track *track = calloc(1, sizeof(*track));
+
+	track->refs = 1;
+	track->available = strncmp(name, "unavailable", 11) != 0;
+	track->playable = strncmp(name, "unplayable", 10) != 0;
+	track->duration = session->track_ms;
+	snprintf(track->name, sizeof(track->name), "%s", name);
+	track->album = album;
+	album->refs++;
+	return track;
+}
+
+static sp_track **tracks_new(sp_session *session, const char *id, int n, sp_album *album)
+{
+	sp_track **tracks = calloc(n, sizeof(*tracks));
+	char name[FAKE_NAME_LEN];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "%.64s #%d", id, i + 1);
+		tracks[i] = track_new(session, name, album);
+	}
+	return tracks;
+}
+
+sp_error sp_album_add_ref(sp_album *album)
+{
+	album->refs++;
+	return SP_ERROR_OK;
+}
+
+sp_error sp_album_release(sp_album *album)
+{
+	if (--album->refs == 0)
+		free(album);
+	return SP_ERROR_OK;
+}
+
+bool sp_album_is_loaded(sp_album *album)
+{
+	return 1;
+}
+
+const char *sp_album_name(sp_album *album)
+{
+	return album->name;
+}
+
+sp_artist *sp_album_artist(sp_album *album)
+{
+	return &album->artist;
+}
+
+const char *sp_artist_name(sp_artist *artist)
+{
+	return artist->name;
+}
+
+sp_error sp_track_add_ref(sp_track *track)
+{
+	track->refs++;
+	return SP_ERROR_OK;
+}
+
+sp_error sp_track_release(sp_track *track)
+{
+	if (--track->refs == 0) {
+		sp_album_release(track->album);
+		free(track);
+	}
+	return SP_ERROR_OK;
+}
+
+bool sp_track_is_loaded(sp_track *track)
+{
+	return track->loaded;
+}
+
+sp_error sp_track_error(sp_track *track)
+{
+	if (!track->loaded)
+		return SP_ERROR_IS_LOADING;
+	return track->playable ? SP_ERROR_OK : SP_ERROR_TRACK_NOT_PLAYABLE;
+}
+
+sp_track_availability sp_track_get_availability(sp_session *session, sp_track *track)
+{
+	return track->loaded && track->available ?
+		SP_TRACK_AVAILABILITY_AVAILABLE : SP_TRACK_AVAILABILITY_UNAVAILABLE;
+}
+
+const char *sp_track_name(sp_track *track)
+{
+	return track->loaded ? track->name : "";
+}
+
+sp_album *sp_track_album(sp_track *track)
+{
+	return track->loaded ? track->album : NULL;
+}
+
+int sp_track_duration(sp_track *track)
+{
+	return track->loaded ? track->duration : 0;
+}
+
+static void track_loaded(sp_session *session, void *arg)
+{
+	sp_track *track = arg;
+
+	track->loaded = 1;
+	sp_track_release(track);
+	if (session->callbacks.metadata_updated)
+		session->callbacks.metadata_updated(session);
+}
+
+
+/* --- Links --- */
+
+sp_link *sp_link_create_from_string(const char *uri)
+{
+	sp_link *link;
+	const char *id;
+
+	if (strncmp(uri, "spotify:", 8) != 0)
+		return NULL;
+	uri += 8;
+
+	link = calloc(1, sizeof(*link));
+	if (!strncmp(uri, "track:", 6)) {
+		link->type = SP_LINKTYPE_TRACK;
+		id = uri + 6;
+	}
+	else if (!strncmp(uri, "album:", 6)) {
+		link->type = SP_LINKTYPE_ALBUM;
+		id = uri + 6;
+	}
+	else if (!strncmp(uri, "playlist:", 9)) {
+		link->type = SP_LINKTYPE_PLAYLIST;
+		id = uri + 9;
+	}
+	else if (!strncmp(uri, "user:", 5) && (id = strstr(uri, ":playlist:"))) {
+		link->type = SP_LINKTYPE_PLAYLIST;
+		id += 10;
+	}
+	else {
+		free(link);
+		return NULL;
+	}
+	if (!*id) {
+		free(link);
+		return NULL;
+	}
+	snprintf(link->id, sizeof(link->id), "%s", id);
+	return link;
+}
+
+/* track ids are the track names, so a link built from a track resolves back to it */
+sp_link *sp_link_create_from_track(sp_track *track, int offset)
+{
+	sp_link *link = calloc(1, sizeof(*link));
+
+	link->type = SP_LINKTYPE_TRACK;
+	snprintf(link->id, sizeof(link->id), "%s", track->name);
+	return link;
+}
+
+int sp_link_as_string(sp_link *link, char *buffer, int buffer_size)
+{
+	static const char *kinds[] = {
+		[SP_LINKTYPE_TRACK] = "track",
+		[SP_LINKTYPE_ALBUM] = "album",
+		[SP_LINKTYPE_PLAYLIST] = "playlist",
+	};
+
+	return snprintf(buffer, buffer_size, "spotify:%s:%s", kinds[link->type], link->id);
+}
+
+sp_linktype sp_link_type(sp_link *link)
+{
+	return link->type;
+}
+
+sp_error sp_link_release(sp_link *link)
+{
+	if (link->track)
+		sp_track_release(link->track);
+	if (link->album)
+		sp_album_release(link->album);
+	free(link);
+	return SP_ERROR_OK;
+}
+
+/*
+ * The track belongs to the link, as in libspotify; it only becomes loaded
+ * after the configured delay, which is what metadata_updated reports.
+ */
+sp_track *sp_link_as_track(sp_link *link)
+{
+	if (link->type != SP_LINKTYPE_TRACK)
+		return NULL;
+	if (!link->track) {
+		sp_album *album = album_new(link->id);
+		link->track = track_new(fake_session, link->id, album);
+		sp_album_release(album);
+		link->track->refs++;
+		schedule(fake_session, fake_session->delay_ms, track_loaded, link->track);
+	}
+	return link->track;
+}
+
+sp_album *sp_link_as_album(sp_link *link)
+{
+	if (link->type != SP_LINKTYPE_ALBUM)
+		return NULL;
+	if (!link->album)
+		link->album = album_new(link->id);
+	return link->album;
+}
+
+
+/* --- Album browsing --- */
+
+static void albumbrowse_loaded(sp_session *session, void *arg)
+{
+	sp_albumbrowse *browse = arg;
+	int i;
+
+	browse->loaded = 1;
+	for (i = 0; i < browse->ntracks; i++)
+		browse->tracks[i]->loaded = 1;
+	browse->cb(browse, browse->userdata);
+	sp_albumbrowse_release(browse);
+}
+
+sp_albumbrowse *sp_albumbrowse_create(sp_session *session, sp_album *album,
+				      albumbrowse_complete_cb *callback, void *userdata)
+{
+	sp_albumbrowse *browse = calloc(1, sizeof(*browse));
+
+	/* one reference for the caller, one for the pending load */
+	browse->refs = 2;
+	browse->album = album;
+	album->refs++;
+	browse->ntracks = session->album_tracks;
+	browse->tracks = tracks_new(session, album->name, browse->ntracks, album);
+	browse->cb = callback;
+	browse->userdata = userdata;
+	schedule(session, session->delay_ms, albumbrowse_loaded, browse);
+	return browse;
+}
+
+bool sp_albumbrowse_is_loaded(sp_albumbrowse *browse)
+{
+	return browse->loaded;
+}
+
+sp_error sp_albumbrowse_error(sp_albumbrowse *browse)
+{
+	return browse->loaded ? SP_ERROR_OK : SP_ERROR_IS_LOADING;
+}
+
+sp_album *sp_albumbrowse_album(sp_albumbrowse *browse)
+{
+	return browse->loaded ? browse->album : NULL;
+}
+
+int sp_albumbrowse_num_tracks(sp_albumbrowse *browse)
+{
+	return browse->loaded ? browse->ntracks : 0;
+}
+
+sp_track *sp_albumbrowse_track(sp_albumbrowse *browse, int index)
+{
+	if (!browse->loaded || index < 0 || index >= browse->ntracks)
+		return NULL;
+	return browse->tracks[index];
+}
+
+sp_error sp_albumbrowse_release(sp_albumbrowse *browse)
+{
+	int i;
+
+	if (--browse->refs == 0) {
+		for (i = 0; i < browse->ntracks; i++)
+			sp_track_release(browse->tracks[i]);
+		free(browse->tracks);
+		sp_album_release(browse->album);
+		free(browse);
+	}
+	return SP_ERROR_OK;
+}
+
+
+/* --- Playlists --- */
+
+/* callbacks may unregister (and release) from within; walk a copy */
+static void playlist_notify(sp_playlist *pl, int state_changed)
+{
+	struct fake_playlist_cb *cbs;
+	int i, n = pl->ncbs;
+
+	if (!n)
+		return;
+	cbs = malloc(n * sizeof(*cbs));
+	memcpy(cbs, pl->cbs, n * sizeof(*cbs));
+	for (i = 0; i < n; i++) {
+		sp_playlist_callbacks *c = cbs[i].callbacks;
+		if (state_changed && c->playlist_state_changed)
+			c->playlist_state_changed(pl, cbs[i].userdata);
+		else if (!state_changed && c->playlist_metadata_updated)
+			c->playlist_metadata_updated(pl, cbs[i].userdata);
+	}
+	free(cbs);
+}
+
+/*
+ * The tracks come in a bit after the playlist itself, a batch at a time, the
+ * way metadata trickles in.
+ */
+static void playlist_tracks_loaded(sp_session *session, void *arg)
+{
+	sp_playlist *pl = arg;
+	int end = pl->ntracks;
+
+	if (session->load_batch > 0 && pl->nloaded + session->load_batch < end)
+		end = pl->nloaded + session->load_batch;
+	for (; pl->nloaded < end; pl->nloaded++)
+		pl->tracks[pl->nloaded]->loaded = 1;
+	playlist_notify(pl, 0);
+	if (session->callbacks.metadata_updated)
+		session->callbacks.metadata_updated(session);
+	if (pl->nloaded < pl->ntracks)
+		schedule(session, 0, playlist_tracks_loaded, pl);
+	else
+		sp_playlist_release(pl);
+}
+
+static void playlist_loaded(sp_session *session, void *arg)
+{
+	sp_playlist *pl = arg;
+
+	pl->loaded = 1;
+	playlist_notify(pl, 1);
+	schedule(session, session->delay_ms, playlist_tracks_loaded, pl);
+}
+
+sp_playlist *sp_playlist_create(sp_session *session, sp_link *link)
+{
+	sp_playlist *pl;
+	sp_album *album;
+
+	if (link->type != SP_LINKTYPE_PLAYLIST)
+		return NULL;
+
+	pl = calloc(1, sizeof(*pl));
+	/* one reference for the caller, one for the pending loads */
+	pl->refs = 2;
+	pl->ntracks = session->playlist_tracks;
+	album = album_new(link->id);
+	pl->tracks = tracks_new(session, link->id, pl->ntracks, album);
+	sp_album_release(album);
+	schedule(session, session->delay_ms, playlist_loaded, pl);
+	return pl;
+}
+
+bool sp_playlist_is_loaded(sp_playlist *pl)
+{
+	return pl->loaded;
+}
+
+sp_error sp_playlist_add_callbacks(sp_playlist *pl, sp_playlist_callbacks *callbacks,
+				   void *userdata)
+{
+	pl->cbs = realloc(pl->cbs, (pl->ncbs + 1) * sizeof(*pl->cbs));
+	pl->cbs[pl->ncbs].callbacks = callbacks;
+	pl->cbs[pl->ncbs].userdata = userdata;
+	pl->ncbs++;
+	return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_remove_callbacks(sp_playlist *pl, sp_playlist_callbacks *callbacks,
+				      void *userdata)
+{
+	int i;
+
+	for (i = 0; i < pl->ncbs; i++) {
+		if (pl->cbs[i].callbacks == callbacks && pl->cbs[i].userdata == userdata) {
+			memmove(pl->cbs + i, pl->cbs + i + 1, (pl->ncbs - i - 1) * sizeof(*pl->cbs));
+			pl->ncbs--;
+			break;
+		}
+	}
+	return SP_ERROR_OK;
+}
+
+int sp_playlist_num_tracks(sp_playlist *pl)
+{
+	return pl->loaded ? pl->ntracks : 0;
+}
+
+sp_track *sp_playlist_track(sp_playlist *pl, int index)
+{
+	if (!pl->loaded || index < 0 || index >= pl->ntracks)
+		return NULL;
+	return pl->tracks[index];
+}
+
+sp_error sp_playlist_add_ref(sp_playlist *pl)
+{
+	pl->refs++;
+	return SP_ERROR_OK;
+}
+
+sp_error sp_playlist_release(sp_playlist *pl)
+{
+	int i;
+
+	if (--pl->refs == 0) {
+		for (i = 0; i < pl->ntracks; i++)
+			sp_track_release(pl->tracks[i]);
+		free(pl->tracks);
+		free(pl->cbs);
+		free(pl);
+	}
+	return SP_ERROR_OK;
+}
+
+
+/* --- Player --- */
+
+/* a quiet sawtooth, so that a wav dump is recognizable */
+static void fill_pcm(int16_t *dst, int64_t pos, int frames)
+{
+	int i;
+
+	for (i = 0; i < frames; i++) {
+		int16_t v = (int16_t)(((pos + i) * 440 * 65536 / FAKE_RATE) & 0xffff) >> 3;
+		dst[2 * i] = v;
+		dst[2 * i + 1] = v;
+	}
+}
+
+static void wait_ns(sp_session *session, uint64_t ns)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns += ts.tv_nsec;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+	pthread_cond_timedwait(&session->cond, &session->mutex, &ts);
+}
+
+static void *player_thread(void *arg)
+{
+	sp_session *session = arg;
+	sp_audioformat fmt = {
+		.sample_type = SP_SAMPLETYPE_INT16_NATIVE_ENDIAN,
+		.sample_rate = FAKE_RATE,
+		.channels = FAKE_CHANNELS,
+	};
+
+	pthread_mutex_lock(&session->mutex);
+	for (;;) {
+		int64_t end, n, got;
+
+		if (!session->track || !session->playing) {
+			pthread_cond_wait(&session->cond, &session->mutex);
+			continue;
+		}
+
+		end = (int64_t)session->track->duration * FAKE_RATE / 1000;
+		if (session->pos >= end) {
+			session->playing = 0;
+			pthread_mutex_unlock(&session->mutex);
+			if (session->callbacks.end_of_track)
+				session->callbacks.end_of_track(session);
+			pthread_mutex_lock(&session->mutex);
+			continue;
+		}
+		n = end - session->pos;
+		if (n > session->chunk_frames)
+			n = session->chunk_frames;
+
+		/* a chunk goes out when playback reaches its start, like a decoder would */
+		if (session->speed > 0) {
+			uint64_t at = session->pace_start_ns +
+				(uint64_t)(session->pace_frames * 1e9 / (FAKE_RATE * session->speed));
+			uint64_t now = now_ns();
+			if (at > now) {
+				wait_ns(session, at - now);
+				continue;
+			}
+		}
+
+		fill_pcm(session->buf, session->pos, n);
+		got = session->callbacks.music_delivery(session, &fmt, session->buf, n);
+		session->pos += got;
+		session->pace_frames += got;
+		if (got == 0) {
+			/* the consumer is full; don't make up for it with a burst */
+			session->pace_start_ns = now_ns();
+			session->pace_frames = 0;
+			wait_ns(session, 5000000);
+		}
+	}
+	return NULL;
+}
+
+sp_error sp_session_player_load(sp_session *session, sp_track *track)
+{
+	if (!track->loaded)
+		return SP_ERROR_IS_LOADING;
+	if (!track->playable)
+		return SP_ERROR_TRACK_NOT_PLAYABLE;
+
+	track->refs++;
+	pthread_mutex_lock(&session->mutex);
+	if (session->track)
+		sp_track_release(session->track);
+	session->track = track;
+	session->playing = 0;
+	session->pos = 0;
+	pthread_mutex_unlock(&session->mutex);
+	return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_play(sp_session *session, bool play)
+{
+	pthread_mutex_lock(&session->mutex);
+	session->playing = play;
+	session->pace_start_ns = now_ns();
+	session->pace_frames = 0;
+	pthread_cond_signal(&session->cond);
+	pthread_mutex_unlock(&session->mutex);
+	return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_unload(sp_session *session)
+{
+	pthread_mutex_lock(&session->mutex);
+	if (session->track)
+		sp_track_release(session->track);
+	session->track = NULL;
+	session->playing = 0;
+	pthread_mutex_unlock(&session->mutex);
+	return SP_ERROR_OK;
+}
+
+sp_error sp_session_player_prefetch(sp_session *session, sp_track *track)
+{
+	return track->loaded ? SP_ERROR_OK : SP_ERROR_IS_LOADING;
+}
+
+
+/* --- Session --- */
+
+sp_error sp_session_create(const sp_session_config *config, sp_session **sess)
+{
+	sp_session *session = calloc(1, sizeof(*session));
+
+	session->callbacks = *config->callbacks;
+	session->userdata = config->userdata;
+	session->delay_ms = env_int("FAKE_SPOTIFY_DELAY_MS", 100);
+	session->track_ms = env_int("FAKE_SPOTIFY_TRACK_MS", 180000);
+	session->album_tracks = env_int("FAKE_SPOTIFY_ALBUM_TRACKS", 10);
+	session->playlist_tracks = env_int("FAKE_SPOTIFY_PLAYLIST_TRACKS", 20);
+	session->chunk_frames = env_int("FAKE_SPOTIFY_CHUNK_FRAMES", 2048);
+	session->load_batch = env_int("FAKE_SPOTIFY_LOAD_BATCH", 0);
+	if (session->chunk_frames < 1)
+		session->chunk_frames = 1;
+	session->buf = malloc(session->chunk_frames * FAKE_CHANNELS * sizeof(int16_t));
+	session->speed = getenv("FAKE_SPOTIFY_SPEED") ? atof(getenv("FAKE_SPOTIFY_SPEED")) : 1;
+
+	pthread_mutex_init(&session->mutex, NULL);
+	pthread_cond_init(&session->cond, NULL);
+	pthread_create(&session->thread, NULL, player_thread, session);
+
+	fake_session = session;
+	*sess = session;
+	log_info("fake libspotify: delay %d ms, tracks of %d ms, %gx real time",
+		session->delay_ms, session->track_ms, session->speed);
+	return SP_ERROR_OK;
+}
+
+void *sp_session_userdata(sp_session *session)
+{
+	return session->userdata;
+}
+
+static void logged_in(sp_session *session, void *arg)
+{
+	char blob[FAKE_NAME_LEN + 16];
+
+	if (session->remember_me && session->callbacks.credentials_blob_updated) {
+		snprintf(blob, sizeof(blob), "fake-blob-%.100s", session->username);
+		session->callbacks.credentials_blob_updated(session, blob);
+	}
+	session->callbacks.logged_in(session, SP_ERROR_OK);
+}
+
+static void logged_out(sp_session *session, void *arg)
+{
+	if (session->callbacks.logged_out)
+		session->callbacks.logged_out(session);
+}
+
+sp_error sp_session_login(sp_session *session, const char *username, const char *password,
+			  bool remember_me, const char *blob)
+{
+	snprintf(session->username, sizeof(session->username), "%s", username);
+	session->remember_me = remember_me;
+	schedule(session, blob ? session->delay_ms / 4 : session->delay_ms, logged_in, NULL);
+	return SP_ERROR_OK;
+}
+
+/* nothing is remembered across runs */
+sp_error sp_session_relogin(sp_session *session)
+{
+	return SP_ERROR_NO_CREDENTIALS;
+}
+
+int sp_session_remembered_user(sp_session *session, char *buffer, size_t buffer_size)
+{
+	return -1;
+}
+
+sp_error sp_session_logout(sp_session *session)
+{
+	sp_session_player_unload(session);
+	schedule(session, 0, logged_out, NULL);
+	return SP_ERROR_OK;
+}
+
+sp_error sp_session_process_events(sp_session *session, int *next_timeout)
+{
+	struct fake_event *ev;
+	uint64_t now;
+
+	while ((ev = session->events) && ev->due_ns <= now_ns()) {
+		session->events = ev->next;
+		ev->run(session, ev->arg);
+		free(ev);
+	}
+
+	now = now_ns();
+	if (!session->events)
+		*next_timeout = 1000;
+	else if (session->events->due_ns <= now)
+		*next_timeout = 0;
+	else
+		*next_timeout = (session->events->due_ns - now) / 1000000 + 1;
+	return SP_ERROR_OK;
+}
+
+const char *sp_error_message(sp_error error)
+{
+	switch (error) {
+	case SP_ERROR_OK:
+		return "No error";
+	case SP_ERROR_IS_LOADING:
+		return "Resource not loaded yet";
+	case SP_ERROR_TRACK_NOT_PLAYABLE:
+		return "Track not playable";
+	default:
+		return "Unknown error";
+	}
+}
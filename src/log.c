@@ -0,0 +1,233 @@
+/*
+ * Every thread that logs gets its own single producer / single consumer
+ * ring, so logging costs a vsnprintf and no lock. The writer thread merges
+ * the rings back in order using a global sequence number. When a ring is
+ * full, threads that called log_set_blocking() write everything out
+ * themselves; the others, audio and libspotify threads, drop the message
+ * and count it rather than wait.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define LOG_RING_MASK (LOG_RING_SLOTS - 1)
+
+
+struct log_entry {
+	uint64_t seq;
+	char msg[LOG_MSG_MAX];
+};
+
+struct log_ring {
+	unsigned int head;    /* written by the writer */
+	unsigned int tail;    /* written by the owning thread */
+	unsigned int dropped;
+	struct log_ring *next;
+	struct log_entry entries[LOG_RING_SLOTS];
+};
+
+int log_level = LOG_LEVEL_INFO;
+
+/* a thread's ring is written out and freed when the thread exits */
+static struct log_ring *rings;
+static __thread struct log_ring *thread_ring;
+static __thread const char *thread_prefix = "";
+static __thread int thread_blocking;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static uint64_t next_seq;
+
+static int started;
+static int writer_sleeping;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void ring_free(void *arg);
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_free);
+}
+
+static struct log_ring *ring_get(void)
+{
+	struct log_ring *r = thread_ring;
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		thread_ring = r;
+		pthread_once(&ring_key_once, ring_key_create);
+		pthread_setspecific(ring_key, r);
+	}
+	return r;
+}
+
+/*
+ * Thread exit: writes out what is left in the ring, then unlinks it. Rings
+ * are only unlinked with drain_mutex held, so walking the list under it is
+ * safe; new rings are only ever pushed in front.
+ */
+static void ring_free(void *arg)
+{
+	struct log_ring *r = arg, *expected = r, *p;
+
+	log_flush();
+	pthread_mutex_lock(&drain_mutex);
+	if (!__atomic_compare_exchange_n(&rings, &expected, r->next, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		for (p = expected; p->next != r; p = p->next)
+			;
+		p->next = r->next;
+	}
+	pthread_mutex_unlock(&drain_mutex);
+	thread_ring = NULL;
+	free(r);
+}
+
+static int pending(void)
+{
+	struct log_ring *r;
+	int n = 0;
+
+	pthread_mutex_lock(&drain_mutex);
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r && !n; r = r->next)
+		n = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head;
+	pthread_mutex_unlock(&drain_mutex);
+	return n;
+}
+
+/*
+ * Writes out everything queued so far, oldest first. Safe from any thread.
+ */
+void log_flush(void)
+{
+	struct log_ring *r, *oldest;
+	struct log_entry *e;
+	unsigned int dropped;
+
+	pthread_mutex_lock(&drain_mutex);
+	for (;;) {
+		oldest = NULL;
+		for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+			if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head)
+				continue;
+			if (!oldest || r->entries[r->head & LOG_RING_MASK].seq <
+				       oldest->entries[oldest->head & LOG_RING_MASK].seq)
+				oldest = r;
+		}
+		if (!oldest)
+			break;
+		e = &oldest->entries[oldest->head & LOG_RING_MASK];
+		fputs(e->msg, stderr);
+		fputc('\n', stderr);
+		__atomic_store_n(&oldest->head, oldest->head + 1, __ATOMIC_RELEASE);
+	}
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		if ((dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED)))
+			fprintf(stderr, "log: %u messages dropped\n", dropped);
+	fflush(stderr);
+	pthread_mutex_unlock(&drain_mutex);
+}
+
+static void *log_writer(void *arg)
+{
+	for (;;) {
+		log_flush();
+
+		/* about to sleep: announce it, then check again */
+		__atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (pending()) {
+			__atomic_store_n(&writer_sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		pthread_mutex_lock(&wake_mutex);
+		while (__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&wake_cond, &wake_mutex);
+		pthread_mutex_unlock(&wake_mutex);
+	}
+	return NULL;
+}
+
+void log_write(const char *fmt, ...)
+{
+	struct log_ring *r = ring_get();
+	unsigned int tail = r->tail;
+	struct log_entry *e;
+	va_list ap;
+	size_t len;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+		if (!thread_blocking) {
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		log_flush();
+	}
+
+	e = &r->entries[tail & LOG_RING_MASK];
+	len = snprintf(e->msg, sizeof(e->msg), "%s", thread_prefix);
+	va_start(ap, fmt);
+	vsnprintf(e->msg + len, sizeof(e->msg) - len, fmt, ap);
+	va_end(ap);
+	len = strlen(e->msg);
+	while (len && e->msg[len - 1] == '\n')
+		e->msg[--len] = '\0';
+	e->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	if (!__atomic_load_n(&started, __ATOMIC_RELAXED)) {
+		/* no writer yet */
+		log_flush();
+	}
+	else if (__atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&wake_mutex);
+		pthread_cond_signal(&wake_cond);
+		pthread_mutex_unlock(&wake_mutex);
+	}
+}
+
+/*
+ * Prepended to every message the calling thread logs from now on; the string
+ * must outlive the thread.
+ */
+void log_set_prefix(const char *prefix)
+{
+	thread_prefix = prefix;
+}
+
+/*
+ * Makes the calling thread write its messages out itself when its ring is
+ * full, rather than drop them. For the threads that may block on stderr:
+ * the main thread and the event loops, not the audio path.
+ */
+void log_set_blocking(int blocking)
+{
+	thread_blocking = blocking;
+}
+
+/*
+ * Starts the writer thread. Until then messages are written synchronously;
+ * whatever is still queued at exit() is flushed.
+ */
+void log_init(void)
+{
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, log_writer, NULL))
+		return;
+	pthread_detach(tid);
+	atexit(log_flush);
+	__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,41 @@
+/*
+ * Leveled logging that does not block the calling thread on I/O: messages
+ * are formatted into a ring owned by the calling thread, and a background
+ * thread writes them out to stderr in order. Only threads that asked for it
+ * with log_set_blocking() ever write themselves, when their ring is full.
+ */
+#ifndef _SPOTIFY_CMD_LOG_H_
+#define _SPOTIFY_CMD_LOG_H_
+
+
+/* --- Definitions --- */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#define LOG_MSG_MAX 256   /* longer messages are truncated */
+#define LOG_RING_SLOTS 64 /* per thread, must be a power of two */
+
+/* the arguments are only evaluated when the level is on */
+#define log_at(level, ...) do { \
+	if ((level) <= log_level) \
+		log_write(__VA_ARGS__); \
+} while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+
+/* --- Functions --- */
+extern int log_level; /* runtime threshold, LOG_LEVEL_INFO by default */
+
+void log_init(void);
+void log_flush(void);
+void log_set_prefix(const char *prefix);
+void log_set_blocking(int blocking);
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif /* _SPOTIFY_CMD_LOG_H_ */
@@ -7,77 +7,214 @@
 #include <event2/thread.h>
 #include <event2/util.h>
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "audio.h"
+#include "log.h"
+#include "playqueue.h"
+#include "search.h"
+#include "shuffle.h"
+#include "timeline.h"
+#include "trackstore.h"
+#include "uriindex.h"
 
+/// How long before the end of a track the next one gets prefetched
+#define PREFETCH_MARGIN_MS 15000
 
-/// The output queue for audo data
-static audio_fifo_t g_audiofifo;
+/// Tracks kept referenced around the current one: previous, current, next
+#define NEAR_TRACKS 3
+
+/// Upper bounds, in seconds, of the /metrics track load latency histogram
+static const double trackLoadBounds[] = { 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5 };
+#define TRACK_LOAD_BUCKETS (sizeof(trackLoadBounds) / sizeof(trackLoadBounds[0]))
+
+/// The credentials blob libspotify hands us, kept between runs in the settings
+/// location of the zone (user, then blob)
+#define CREDENTIALS_FILE "credentials"
+/// Longest credentials blob kept, newline included
+#define CREDENTIALS_BLOB_MAX 4096
+
+/// Album and playlist contents, kept in the cache directory between runs
+#define URI_INDEX_FILE "tracklist.idx"
+/// Index entries older than this are resolved again before being used
+#define URI_INDEX_MAX_AGE (7 * 24 * 3600)
+
+/// The shuffle order, kept in the cache directory so that a restart resumes it
+#define SHUFFLE_FILE "shuffle"
+
+/// How many matches find lists
+#define SEARCH_RESULTS 10
+/// How many matches play locates one by one before walking the tracklist
+#define PLAY_SCAN_MATCHES 64
+
+/// Tracklist entries are track store ids, offset so that none is NULL
+#define TRACK_ITEM(id) ((void *)(uintptr_t)((id) + 1))
+#define ITEM_TRACK(item) ((int)(uintptr_t)(item) - 1)
+
+/// Separates the arguments of each zone (player) on the command line
+#define ZONE_SEPARATOR "--"
 
 
 // Application key
 extern const unsigned char g_appkey[]; 
 extern const size_t g_appkey_size; 
 
-static int exit_status = EXIT_FAILURE;
-
-// Spotify account information
-struct account {
-  const char *username;
-  const char *password;
-} account;
-
+/// Command line settings shared by every zone
+struct options {
+  int tracklistWindow;
+  int waitForTracklist;
+  int shuffle;
+  int daemon;
+  int httpPort;           // of the first zone, the next ones take the next ports
+  const char *cacheLocation;
+  const char *output;
+  int depthMin, depthTarget, depthMax;
+};
+
+/// One zone: a session, its account, its tracklist and its audio output
 struct state {
+  int zone;
+  char logPrefix[16];
+  int exitStatus;
+  pthread_t thread;
+
   sp_session *session;
+  const char *username;
+  const char *password;   // NULL when given as "-": stored credentials only
 
   struct event_base *event_base;
   struct event *async;
   struct event *timer;
   struct event *sigint;
   struct timeval next_timeout;
-  struct event *ev_stdin;
+  struct event *ev_stdin; // first zone only
 
   struct evhttp *http;
+  int daemon;    // stay logged in and idle when there is nothing left to play
+  int loginWithBlob;
+  int loggedIn;
+  char cacheLocation[1024];
+  char settingsLocation[1024];
+  int httpPort;
+  int paused;
 
   sp_track *currentTrack;
+  int currentTrackId;
+  sp_track *prefetchTrack; // referenced ahead of its turn, to load it early
+  int prefetchTrackId;
+  sp_track *nearTracks[NEAR_TRACKS]; // referenced while next to the current track,
+  int nearTrackIds[NEAR_TRACKS];     // so that their metadata stays loaded
   int currentTrackPlaying;
-  unsigned int currentTrackIdx;
   struct event *endOfTrack;
+  struct event *prefetch;
+
+  // set at a track boundary, cleared by the first delivery of the new track
+  int boundaryPending;
+  int boundaryQueued;
+  unsigned int boundariesGapless;
+  unsigned int boundariesStarved;
+
+  // playTrack to launchPlayCurrentTrack, for /metrics
+  struct timespec trackLoadStart;
+  unsigned int trackLoadBuckets[TRACK_LOAD_BUCKETS];
+  unsigned int trackLoads;
+  double trackLoadSeconds;
+
+  unsigned long processEventsCalls;
 
   const char **urisToPlay;
   int nbUrisToPlay;
 
-  sp_track **tracklist;
-  unsigned int tracklistLen;
-  int tracklistSomethingLoading;
-  int tracklistLoadingIdx;
-  sp_albumbrowse *tracklistCurrentlyLoadingAlbumBrowse;
-  sp_playlist *tracklistCurrentlyLoadingPlaylist;
-  sp_track *tracklistCurrentlyLoadingTrack;
+  playqueue_t tracklist;   // of trackStore ids; its position is the current track
+  track_store_t trackStore; // metadata of every track that went into the tracklist
+  search_index_t search;   // words of trackStore, by the same ids
+  struct playqueue_node **trackNodes; // by trackStore id, NULL once out of the tracklist
+  int trackNodesSize;
+  int shuffle;             // play in shuffleOrder, which then follows the tracklist
+  shuffle_t shuffleOrder;
+  uint64_t tracklistKey;   // cached by tracklistKey(), 0 once the tracklist changed
+  int unplayableInARow;
+
+  struct uriLoad **uriLoads; // NULL when no uri is being resolved
+  int nbUriLoads;
+  int uriLoadsCap;
+  int tracklistWindow;    // max number of uris being resolved at once
+  int tracklistInFlight;
+  int tracklistStartIdx;  // next uri to start resolving
+  int tracklistCommitIdx; // next uri to move into the tracklist
+  struct timespec tracklistFillStart;
+  int waitForTracklist;   // don't start playing before every uri is resolved
+  int playbackStarted;
+  int waitingForTracks;   // current index is past the tracks resolved so far
 
   sp_playlist_callbacks *playlistCallbacks;
-} *state;
+  uri_index_t uriIndex;   // written once the tracklist, or revalidations, are done
+  int revalidations;      // in flight
+
+  unsigned int stuttersReported;
+
+  audio_sink_t *audioSink;
+  audio_fifo_t audiofifo;
+};
+
+/// One uri (from the command line or the control API) being resolved into tracks
+struct uriLoad {
+  struct state *state;
+  char *uri;
+  int done;
+  int discard;   // the tracklist was replaced while this was resolving
+  int fromIndex;  // tracks come from the index, waiting for them to load
+  int revalidate; // only refreshes the index, not part of the tracklist
+  int playNext;   // goes right after the current track rather than at the end
+
+  // what we are waiting for, if anything
+  sp_track *track;
+  sp_albumbrowse *albumBrowse;
+  sp_playlist *playlist;
+  int loadedTracks; // leading tracks of playlist, or of tracks, known to be loaded
+
+  // resolved tracks, one reference each
+  sp_track **tracks;
+  int nbTracks;
+};
 
 
 static void playTrack(struct state *state);
+static void keepNearTracks(struct state *state);
 static void tracklistFill(struct state *state);
 
-// Catches SIGINT and exits gracefully
+
+static double msSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Activated on every zone when SIGINT comes in, to exit gracefully
 static void sigint_handler(evutil_socket_t socket,
                            short what,
                            void *userdata) {
-  fprintf(stderr, "signal_handler\n");
+  log_debug("signal_handler");
   struct state *state = userdata;
-  sp_session_logout(state->session);
+  if (state->loggedIn) {
+    sp_session_logout(state->session);
+  }
+  else {
+    event_base_loopbreak(state->event_base);
+  }
 }
 
 
 static void logged_out(sp_session *session) {
-  fprintf(stderr, "logged_out\n");
+  log_debug("logged_out");
   struct state *state = sp_session_userdata(session);
   event_del(state->async);
   event_del(state->timer);
@@ -87,314 +224,1661 @@ static void logged_out(sp_session *session) {
 
 
 static void stdin_setup(struct state *state) {
+  if (NULL == state->ev_stdin) {
+    return ;
+  }
   int flags = fcntl(fileno(stdin), F_GETFL, 0);
-  fprintf(stderr, "flags: %d. stdin non blocking ? %d\n", flags, !!(flags & O_NONBLOCK));
+  log_debug("flags: %d. stdin non blocking ? %d", flags, !!(flags & O_NONBLOCK));
   flags |= O_NONBLOCK;
   int err = fcntl(fileno(stdin), F_SETFL, flags);
-  fprintf(stderr, "res: %d\n", err);
+  log_debug("res: %d", err);
 
   event_add(state->ev_stdin, NULL);
 }
 
 
+/**
+ * Formats playback and audio buffer health, for the status command and the
+ * control API.
+ */
+static void statusFormat(struct state *state, struct evbuffer *buf) {
+  audio_fifo_t *af = &state->audiofifo;
+
+  if (NULL != state->currentTrack) {
+    evbuffer_add_printf(buf, "status: %s [%d/%d] \"%s\"\n", state->paused ? "paused" : "playing",
+                        playqueue_pos(&state->tracklist), playqueue_len(&state->tracklist),
+                        track_store_name(&state->trackStore, state->currentTrackId));
+  }
+  else {
+    evbuffer_add_printf(buf, "status: idle, %d tracks in tracklist\n", playqueue_len(&state->tracklist));
+  }
+  if (NULL != state->uriLoads) {
+    evbuffer_add_printf(buf, "status: resolving uris, %d/%d done\n",
+                        state->tracklistCommitIdx, state->nbUriLoads);
+  }
+  evbuffer_add_printf(buf, "status: buffered %d frames, %u stutters, %u empty waits\n",
+                      audio_fifo_qlen(af), __atomic_load_n(&af->stutters, __ATOMIC_RELAXED),
+                      __atomic_load_n(&af->empty_waits, __ATOMIC_RELAXED));
+  double audioS = __atomic_load_n(&af->dev_audio_us, __ATOMIC_RELAXED) / 1e6;
+  if (audioS > 0) {
+    unsigned int writes = __atomic_load_n(&af->dev_writes, __ATOMIC_RELAXED);
+    unsigned int calls = __atomic_load_n(&af->dev_calls, __ATOMIC_RELAXED);
+    evbuffer_add_printf(buf, "status: device %.1f wakeups, %.1f writes and %.1f calls per second of audio "
+                        "(%.1f calls per write)\n",
+                        __atomic_load_n(&af->dev_wakeups, __ATOMIC_RELAXED) / audioS,
+                        writes / audioS, calls / audioS, writes ? (double)calls / writes : 0);
+  }
+  evbuffer_add_printf(buf, "status: buffer target %d ms (%d..%d), grown %u times, shrunk %u times\n",
+                      __atomic_load_n(&af->depth_target_ms, __ATOMIC_RELAXED), af->depth_min_ms,
+                      af->depth_max_ms, __atomic_load_n(&af->depth_grows, __ATOMIC_RELAXED),
+                      __atomic_load_n(&af->depth_shrinks, __ATOMIC_RELAXED));
+  evbuffer_add_printf(buf, "status: %u skips, last took %.1f ms to new audio (worst %.1f ms), %u stale chunks dropped\n",
+                      __atomic_load_n(&af->skips, __ATOMIC_RELAXED),
+                      __atomic_load_n(&af->skip_ns_last, __ATOMIC_RELAXED) / 1e6,
+                      __atomic_load_n(&af->skip_ns_max, __ATOMIC_RELAXED) / 1e6,
+                      __atomic_load_n(&af->stale_chunks, __ATOMIC_RELAXED));
+  evbuffer_add_printf(buf, "status: track boundaries %u gapless, %u starved (%d frames queued at last one)\n",
+                      state->boundariesGapless, state->boundariesStarved, state->boundaryQueued);
+  evbuffer_add_printf(buf, "status: audio pool %d/%d free, %d free at worst, exhausted %u times\n",
+                      __atomic_load_n(&af->pool_avail, __ATOMIC_RELAXED), af->pool_chunks,
+                      af->pool_min_avail, __atomic_load_n(&af->pool_exhausted, __ATOMIC_RELAXED));
+  evbuffer_add_printf(buf, "status: pipeline %.0f frames/s, queued p50 %.3f ms p99 %.3f ms p99.9 %.3f ms, %u deliveries rejected\n",
+                      audio_fifo_throughput(af),
+                      audio_fifo_latency_us(af, 0.5) / 1e3, audio_fifo_latency_us(af, 0.99) / 1e3,
+                      audio_fifo_latency_us(af, 0.999) / 1e3,
+                      __atomic_load_n(&af->put_rejects, __ATOMIC_RELAXED));
+  struct rusage ru;
+  if (0 == getrusage(RUSAGE_SELF, &ru)) {
+    evbuffer_add_printf(buf, "status: cpu %.2f s user, %.2f s system\n",
+                        ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+                        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    evbuffer_add_printf(buf, "status: memory %ld kB peak resident, metadata %zu kB for %d tracks\n",
+                        ru.ru_maxrss, track_store_bytes(&state->trackStore) / 1024,
+                        state->trackStore.ntracks);
+  }
+}
+
+
+/**
+ * Appends one Prometheus metric to buf: its HELP and TYPE lines, then its
+ * value, under the spotify_cmd_ prefix.
+ */
+static void metric(struct evbuffer *buf, const char *name, const char *type,
+                   const char *help, double value) {
+  evbuffer_add_printf(buf, "# HELP spotify_cmd_%s %s\n", name, help);
+  evbuffer_add_printf(buf, "# TYPE spotify_cmd_%s %s\n", name, type);
+  evbuffer_add_printf(buf, "spotify_cmd_%s %.9g\n", name, value);
+}
+
+
+/**
+ * Prometheus text exposition of the counters behind the status output.
+ * Everything the audio threads update is a relaxed atomic read here.
+ */
+static void metricsFormat(struct state *state, struct evbuffer *buf) {
+  audio_fifo_t *af = &state->audiofifo;
+  unsigned int i, cumulative = 0;
+
+  metric(buf, "fifo_frames", "gauge", "Frames queued between music_delivery and the audio output.",
+         audio_fifo_qlen(af));
+  metric(buf, "fifo_target_seconds", "gauge", "Current jitter buffer target.",
+         __atomic_load_n(&af->depth_target_ms, __ATOMIC_RELAXED) / 1e3);
+  metric(buf, "delivered_frames_total", "counter", "Frames accepted by music_delivery.",
+         __atomic_load_n(&af->frames_in, __ATOMIC_RELAXED));
+  metric(buf, "rejected_deliveries_total", "counter", "music_delivery calls turned down.",
+         __atomic_load_n(&af->put_rejects, __ATOMIC_RELAXED));
+  metric(buf, "played_frames_total", "counter", "Frames handed to the audio output.",
+         __atomic_load_n(&af->frames_out, __ATOMIC_RELAXED));
+  metric(buf, "device_frames", "gauge", "Frames queued in the audio output device.",
+         __atomic_load_n(&af->dev_delay, __ATOMIC_RELAXED));
+  metric(buf, "xruns_total", "counter", "Times the audio output ran dry.",
+         __atomic_load_n(&af->stutters, __ATOMIC_RELAXED));
+  metric(buf, "device_opens_total", "counter", "Times the audio output was (re)opened.",
+         __atomic_load_n(&af->dev_opens, __ATOMIC_RELAXED));
+  metric(buf, "device_writes_total", "counter", "Writes to the audio output.",
+         __atomic_load_n(&af->dev_writes, __ATOMIC_RELAXED));
+  metric(buf, "device_calls_total", "counter", "Calls to the audio device library while playing (snd_pcm_* with ALSA, 0 otherwise).",
+         __atomic_load_n(&af->dev_calls, __ATOMIC_RELAXED));
+
+  evbuffer_add_printf(buf, "# HELP spotify_cmd_queue_latency_seconds Time chunks spend queued before the audio output gets them.\n");
+  evbuffer_add_printf(buf, "# TYPE spotify_cmd_queue_latency_seconds summary\n");
+  evbuffer_add_printf(buf, "spotify_cmd_queue_latency_seconds{quantile=\"0.5\"} %.6f\n",
+                      audio_fifo_latency_us(af, 0.5) / 1e6);
+  evbuffer_add_printf(buf, "spotify_cmd_queue_latency_seconds{quantile=\"0.99\"} %.6f\n",
+                      audio_fifo_latency_us(af, 0.99) / 1e6);
+  evbuffer_add_printf(buf, "spotify_cmd_queue_latency_seconds{quantile=\"0.999\"} %.6f\n",
+                      audio_fifo_latency_us(af, 0.999) / 1e6);
+
+  evbuffer_add_printf(buf, "# HELP spotify_cmd_skip_seconds Time from a skip to audio of the new track.\n");
+  evbuffer_add_printf(buf, "# TYPE spotify_cmd_skip_seconds summary\n");
+  evbuffer_add_printf(buf, "spotify_cmd_skip_seconds_sum %.6f\n",
+                      __atomic_load_n(&af->skip_ns_sum, __ATOMIC_RELAXED) / 1e9);
+  evbuffer_add_printf(buf, "spotify_cmd_skip_seconds_count %u\n",
+                      __atomic_load_n(&af->skips, __ATOMIC_RELAXED));
+
+  evbuffer_add_printf(buf, "# HELP spotify_cmd_track_load_seconds Time from picking a track to starting its playback.\n");
+  evbuffer_add_printf(buf, "# TYPE spotify_cmd_track_load_seconds histogram\n");
+  for (i = 0; i < TRACK_LOAD_BUCKETS; i++) {
+    cumulative += state->trackLoadBuckets[i];
+    evbuffer_add_printf(buf, "spotify_cmd_track_load_seconds_bucket{le=\"%g\"} %u\n",
+                        trackLoadBounds[i], cumulative);
+  }
+  evbuffer_add_printf(buf, "spotify_cmd_track_load_seconds_bucket{le=\"+Inf\"} %u\n", state->trackLoads);
+  evbuffer_add_printf(buf, "spotify_cmd_track_load_seconds_sum %.6f\n", state->trackLoadSeconds);
+  evbuffer_add_printf(buf, "spotify_cmd_track_load_seconds_count %u\n", state->trackLoads);
+
+  metric(buf, "process_events_total", "counter", "sp_session_process_events calls.",
+         state->processEventsCalls);
+}
+
+
+static void logBuffer(struct evbuffer *buf) {
+  char *line;
+  while (NULL != (line = evbuffer_readln(buf, NULL, EVBUFFER_EOL_LF))) {
+    log_info("%s", line);
+    free(line);
+  }
+}
+
+
+static void printStatus(struct state *state) {
+  struct evbuffer *buf = evbuffer_new();
+  statusFormat(state, buf);
+  logBuffer(buf);
+  evbuffer_free(buf);
+}
+
+
+/**
+ * Identifies the tracklist by the uris of its tracks, in order, to tell
+ * whether a saved shuffle order is about it. Only computed again after the
+ * tracklist changed.
+ */
+static uint64_t tracklistKey(struct state *state) {
+  if (0 != state->tracklistKey) {
+    return state->tracklistKey;
+  }
+  uint64_t h = 14695981039346656037ull; // FNV-1a
+  for (int i=0; i<playqueue_len(&state->tracklist); ++i) {
+    const char *uri = track_store_uri(&state->trackStore, ITEM_TRACK(playqueue_at(&state->tracklist, i)));
+    for (; *uri; ++uri) {
+      h = (h ^ (unsigned char)*uri) * 1099511628211ull;
+    }
+    h = (h ^ '\n') * 1099511628211ull;
+  }
+  state->tracklistKey = h ? h : 1;
+  return state->tracklistKey;
+}
+
+
+static void shuffleSave(struct state *state) {
+  char path[sizeof(state->cacheLocation) + sizeof(SHUFFLE_FILE) + 1];
+  snprintf(path, sizeof(path), "%s/%s", state->cacheLocation, SHUFFLE_FILE);
+  shuffle_save(&state->shuffleOrder, path, tracklistKey(state));
+}
+
+
+/**
+ * Starts shuffling the whole tracklist: where the saved order left off if it
+ * is about the same tracks, from a new order otherwise.
+ */
+static void shuffleStart(struct state *state) {
+  char path[sizeof(state->cacheLocation) + sizeof(SHUFFLE_FILE) + 1];
+  playqueue_t *q = &state->tracklist;
+  snprintf(path, sizeof(path), "%s/%s", state->cacheLocation, SHUFFLE_FILE);
+  if (0 == shuffle_load(&state->shuffleOrder, path, tracklistKey(state), playqueue_len(q))) {
+    log_info("resuming shuffle at %d/%d", state->shuffleOrder.idx, playqueue_len(q));
+  }
+  else {
+    shuffle_reset(&state->shuffleOrder, playqueue_len(q), playqueue_len(q));
+  }
+  playqueue_jump(q, shuffle_current(&state->shuffleOrder));
+}
+
+
+/**
+ * Moves to the track after the current one. In shuffle order, which wraps
+ * around by itself; otherwise to the next position, wrapping only with wrap
+ * and once every track is known.
+ */
+static void tracklistStep(struct state *state, int wrap) {
+  playqueue_t *q = &state->tracklist;
+  if (state->shuffle) {
+    playqueue_jump(q, shuffle_next(&state->shuffleOrder));
+    shuffleSave(state);
+    return ;
+  }
+  playqueue_jump(q, playqueue_pos(q) + 1);
+  if (wrap && playqueue_pos(q) == playqueue_len(q) && NULL == state->uriLoads) {
+    playqueue_jump(q, 0); // loop
+  }
+}
+
+
+static void playNext(struct state *state) {
+  log_info("going to next track");
+  tracklistStep(state, 1);
+  playTrack(state);
+}
+
+
+static void playPrev(struct state *state) {
+  log_info("going to previous track");
+  playqueue_t *q = &state->tracklist;
+  if (state->shuffle) {
+    playqueue_jump(q, shuffle_prev(&state->shuffleOrder));
+    shuffleSave(state);
+  }
+  else {
+    playqueue_jump(q, playqueue_pos(q) > 0 ? playqueue_pos(q) - 1 : playqueue_len(q) - 1);
+  }
+  playTrack(state);
+}
+
+
+static void toggleShuffle(struct state *state) {
+  state->shuffle = !state->shuffle;
+  log_info("shuffle %s", state->shuffle ? "on" : "off");
+  if (state->shuffle && state->playbackStarted) {
+    shuffle_reset(&state->shuffleOrder, playqueue_len(&state->tracklist), playqueue_pos(&state->tracklist));
+    shuffleSave(state);
+  }
+}
+
+
+static void togglePause(struct state *state) {
+  if (NULL == state->currentTrack) {
+    return ;
+  }
+  state->paused = !state->paused;
+  log_info("%s", state->paused ? "pausing" : "resuming");
+  sp_session_player_play(state->session, !state->paused);
+  // hold what is already queued too, not only what libspotify delivers
+  audio_fifo_pause(&state->audiofifo, state->paused);
+}
+
+
+/**
+ * Makes the track at pos (from 0) the current one and plays it. Returns -1,
+ * leaving playback alone, if there is no such track.
+ */
+static int tracklistJump(struct state *state, int pos) {
+  if (pos < 0 || pos >= playqueue_len(&state->tracklist)) {
+    log_warn("no track %d to jump to", pos);
+    return -1;
+  }
+  log_info("jumping to track %d", pos);
+  if (state->shuffle && state->playbackStarted) {
+    shuffle_jump(&state->shuffleOrder, pos);
+    pos = shuffle_current(&state->shuffleOrder);
+  }
+  playqueue_jump(&state->tracklist, pos);
+  playTrack(state);
+  return 0;
+}
+
+
+/**
+ * Takes the track at pos out of the tracklist. If it was playing, the next
+ * one starts. Returns -1 if there is no such track.
+ */
+static int tracklistRemove(struct state *state, int pos) {
+  int current = (pos == playqueue_pos(&state->tracklist));
+  void *item = playqueue_remove(&state->tracklist, pos);
+  if (NULL == item) {
+    log_warn("no track %d to remove", pos);
+    return -1;
+  }
+  state->tracklistKey = 0;
+  // its metadata stays in the store until the tracklist is cleared
+  log_info("removed track %d \"%s\"", pos, track_store_name(&state->trackStore, ITEM_TRACK(item)));
+  search_index_remove(&state->search, ITEM_TRACK(item));
+  state->trackNodes[ITEM_TRACK(item)] = NULL;
+  if (state->shuffle && state->playbackStarted) {
+    shuffle_remove(&state->shuffleOrder, pos);
+    playqueue_jump(&state->tracklist, shuffle_current(&state->shuffleOrder));
+  }
+  if (current && state->playbackStarted) {
+    playTrack(state);
+  }
+  else if (state->playbackStarted) {
+    keepNearTracks(state);
+  }
+  return 0;
+}
+
+
+/**
+ * Moves the track at from to position to; whatever plays keeps playing.
+ * Returns -1, moving nothing, if either position is past the tracklist.
+ */
+static int tracklistMove(struct state *state, int from, int to) {
+  int len = playqueue_len(&state->tracklist);
+  if (from < 0 || from >= len || to < 0 || to >= len) {
+    log_warn("cannot move track %d to %d, there are %d", from, to, len);
+    return -1;
+  }
+  log_info("moving track %d to %d", from, to);
+  playqueue_move(&state->tracklist, from, to);
+  state->tracklistKey = 0;
+  if (state->shuffle && state->playbackStarted) {
+    shuffle_move(&state->shuffleOrder, from, to);
+  }
+  if (state->playbackStarted) {
+    keepNearTracks(state);
+  }
+  return 0;
+}
+
+
+/**
+ * Lists the tracks matching query: every word of it has to start a word of
+ * the name, album or artist of the track, regardless of case and accents.
+ * Those that already failed to play are marked unplayable.
+ */
+static void findFormat(struct state *state, const char *query, struct evbuffer *buf) {
+  int ids[SEARCH_RESULTS + 1];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int n = search_index_find(&state->search, query, ids, SEARCH_RESULTS + 1);
+  double us = msSince(&start) * 1000;
+
+  evbuffer_add_printf(buf, "find \"%s\": %s%d match%s in %.1f us\n", query,
+                      n > SEARCH_RESULTS ? "more than " : "", n > SEARCH_RESULTS ? SEARCH_RESULTS : n,
+                      n == 1 ? "" : "es", us);
+  for (int i=0; i<n && i<SEARCH_RESULTS; ++i) {
+    int available = track_store_flags(&state->trackStore, ids[i]) & TRACK_STORE_AVAILABLE;
+    evbuffer_add_printf(buf, " [%d] \"%s\" (\"%s\" // \"%s\")%s\n", playqueue_node_pos(state->trackNodes[ids[i]]),
+                        track_store_name(&state->trackStore, ids[i]), track_store_album(&state->trackStore, ids[i]),
+                        track_store_artist(&state->trackStore, ids[i]), available ? "" : " unplayable");
+  }
+}
+
+
+static void printFind(struct state *state, const char *query) {
+  struct evbuffer *buf = evbuffer_new();
+  findFormat(state, query, buf);
+  logBuffer(buf);
+  evbuffer_free(buf);
+}
+
+
+struct firstMatch {
+  struct state *state;
+  search_query_t query;
+  int pos;
+  int n;
+};
+
+static int firstMatchVisit(void *arg, int id) {
+  struct firstMatch *first = arg;
+  int p = playqueue_node_pos(first->state->trackNodes[id]);
+  first->pos = (p < first->pos) ? p : first->pos;
+  return 0 == first->pos || ++first->n == PLAY_SCAN_MATCHES;
+}
+
+static int firstMatchItem(void *arg, void *item) {
+  struct firstMatch *first = arg;
+  return search_query_match(&first->state->search, &first->query, ITEM_TRACK(item));
+}
+
+/**
+ * Jumps to the first track in the tracklist among those matching query.
+ * Matches come by store id: the first PLAY_SCAN_MATCHES of them give a
+ * position, and when there are more, the tracklist is walked up to it in
+ * case one of the others comes before.
+ */
+static int tracklistPlayQuery(struct state *state, const char *query) {
+  struct firstMatch first = { state };
+  first.pos = playqueue_len(&state->tracklist);
+  if (0 == search_query_init(&state->search, &first.query, query)
+      || 0 == search_query_each(&state->search, &first.query, &firstMatchVisit, &first)) {
+    log_warn("no track matches \"%s\"", query);
+    return -1;
+  }
+  if (PLAY_SCAN_MATCHES == first.n) {
+    int pos = playqueue_find(&state->tracklist, first.pos, &firstMatchItem, &first);
+    first.pos = (pos >= 0) ? pos : first.pos;
+  }
+  return tracklistJump(state, first.pos);
+}
+
+
 static void stdin_data(evutil_socket_t socket,
                        short what,
                        void *userdata) {
   struct state *state = userdata;
   char c;
+  int a, b;
   static char buf[256];
   while (EOF != (c = fgetc(stdin))) {
     ungetc(c, stdin);
     fgets(buf, 256, stdin);
-    fprintf(stderr, "line on stdin: %s\n", buf);
+    log_debug("line on stdin: %s", buf);
     if (!strcmp(buf, "next\n")) {
-      fprintf(stderr, "going to next track\n");
-      state->currentTrackIdx++;
-      if (state->currentTrackIdx == state->tracklistLen) {
-        state->currentTrackIdx = 0; // loop
-      }
-      playTrack(state);
+      playNext(state);
     }
     else if (!strcmp(buf, "prev\n")) {
-      fprintf(stderr, "going to previous track\n");
-      if (state->currentTrackIdx > 0) {
-        state->currentTrackIdx--;
-      }
-      else {
-        state->currentTrackIdx = state->tracklistLen-1;
-      }
-      playTrack(state);
+      playPrev(state);
+    } else if (!strcmp(buf, "pause\n")) {
+      togglePause(state);
+    } else if (!strcmp(buf, "shuffle\n")) {
+      toggleShuffle(state);
+    } else if (!strcmp(buf, "status\n")) {
+      printStatus(state);
     } else if (!strcmp(buf, "stop\n")) {
       sp_session_logout(state->session);
+    } else if (1 == sscanf(buf, "jump %d", &a)) {
+      tracklistJump(state, a);
+    } else if (1 == sscanf(buf, "remove %d", &a)) {
+      tracklistRemove(state, a);
+    } else if (2 == sscanf(buf, "move %d %d", &a, &b)) {
+      tracklistMove(state, a, b);
+    } else if (!strncmp(buf, "find ", 5)) {
+      buf[strcspn(buf, "\n")] = '\0';
+      printFind(state, buf + 5);
+    } else if (!strncmp(buf, "play ", 5)) {
+      buf[strcspn(buf, "\n")] = '\0';
+      tracklistPlayQuery(state, buf + 5);
     }
     else {
-      fprintf(stderr, "unknown command \"%s\"", buf);
+      log_warn("unknown command \"%.*s\"", (int)strcspn(buf, "\n"), buf);
     }
   }
   
 }
 
 
+/**
+ * The current track cannot be played: moves on to the next one.
+ */
+static void skipUnplayable(struct state *state) {
+  track_store_set_flags(&state->trackStore, state->currentTrackId, 0);
+  if (NULL != state->currentTrack) {
+    sp_track_release(state->currentTrack);
+    state->currentTrack = NULL;
+  }
+  if (state->shuffle && ++state->unplayableInARow >= playqueue_len(&state->tracklist)) {
+    // shuffle would go round forever
+    log_error("No playable track left");
+    sp_session_logout(state->session);
+    return ;
+  }
+  tracklistStep(state, 0);
+  playTrack(state);
+}
+
+
 /**
   * Really starts the playing of the current track (assumes it is fully loaded)
   */
 static void launchPlayCurrentTrack(struct state* state) {
-  fprintf(stderr, "launchPlayCurrentTrack, idx %d\n", state->currentTrackIdx);
+  log_debug("launchPlayCurrentTrack, idx %d", playqueue_pos(&state->tracklist));
   sp_error e = sp_session_player_load(state->session, state->currentTrack);
   if (e != SP_ERROR_OK) {
-    fprintf(stderr, "error while launching current track: %s\n", sp_error_message(sp_track_error(state->currentTrack)));
+    log_warn("error while launching current track: %s", sp_error_message(sp_track_error(state->currentTrack)));
     // TODO investigate causes !
-    sp_track_release(state->currentTrack);
-    state->currentTrack = NULL;
-    state->currentTrackIdx++;
-    playTrack(state);
+    skipUnplayable(state);
   }
   else {
+    timeline_mark(TIMELINE_PLAYER_LOAD);
+    state->unplayableInARow = 0;
+    double s = msSince(&state->trackLoadStart) / 1000;
+    unsigned int i = 0;
+    while (i < TRACK_LOAD_BUCKETS && s > trackLoadBounds[i]) {
+      i++;
+    }
+    if (i < TRACK_LOAD_BUCKETS) {
+      state->trackLoadBuckets[i]++;
+    }
+    state->trackLoads++;
+    state->trackLoadSeconds += s;
+
     state->currentTrackPlaying = 1;
+    state->paused = 0;
+    audio_fifo_pause(&state->audiofifo, 0);
     sp_session_player_play(state->session, 1);
+
+    // get the next track into libspotify's cache before this one ends
+    int ms = sp_track_duration(state->currentTrack) - PREFETCH_MARGIN_MS;
+    if (ms < 0) {
+      ms = 0;
+    }
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    evtimer_add(state->prefetch, &tv);
+  }
+}
+
+
+/**
+ * Creates the libspotify track of a tracklist entry from its uri, with a
+ * reference held. Unless libspotify still holds it, its metadata has to load.
+ */
+static sp_track *trackFromUri(struct state *state, int id) {
+  sp_link *l = sp_link_create_from_string(track_store_uri(&state->trackStore, id));
+  if (NULL == l) {
+    return NULL;
+  }
+  sp_track *track = sp_link_as_track(l);
+  if (NULL != track) {
+    sp_track_add_ref(track);
+  }
+  sp_link_release(l);
+  return track;
+}
+
+
+/**
+ * Gets the libspotify track of a tracklist entry back, with a reference held:
+ * the one already referenced when the entry is near the current one or
+ * prefetched, else a new one, which may still have to load.
+ */
+static sp_track *tracklistTrack(struct state *state, int id) {
+  for (int i=0; i<NEAR_TRACKS; ++i) {
+    if (id == state->nearTrackIds[i] && NULL != state->nearTracks[i]) {
+      sp_track_add_ref(state->nearTracks[i]);
+      return state->nearTracks[i];
+    }
+  }
+  if (id == state->prefetchTrackId) {
+    sp_track_add_ref(state->prefetchTrack);
+    return state->prefetchTrack;
+  }
+  return trackFromUri(state, id);
+}
+
+
+static void releaseNearTracks(struct state *state) {
+  for (int i=0; i<NEAR_TRACKS; ++i) {
+    if (NULL != state->nearTracks[i]) {
+      sp_track_release(state->nearTracks[i]);
+      state->nearTracks[i] = NULL;
+    }
+    state->nearTrackIds[i] = -1;
+  }
+}
+
+
+/**
+ * Keeps the tracks before, at and after the current position referenced,
+ * in the order they play in, and lets go of the others: a skip either way
+ * then finds its track with metadata.
+ */
+static void keepNearTracks(struct state *state) {
+  playqueue_t *q = &state->tracklist;
+  int pos = playqueue_pos(q);
+  int near[NEAR_TRACKS] = {
+    state->shuffle ? shuffle_peek_prev(&state->shuffleOrder) : (pos > 0 ? pos - 1 : playqueue_len(q) - 1),
+    pos,
+    state->shuffle ? shuffle_peek(&state->shuffleOrder) : pos + 1,
+  };
+  sp_track *tracks[NEAR_TRACKS];
+  int ids[NEAR_TRACKS];
+
+  for (int i=0; i<NEAR_TRACKS; ++i) {
+    void *item = playqueue_at(q, near[i]);
+    ids[i] = (NULL != item) ? ITEM_TRACK(item) : -1;
+    tracks[i] = (NULL != item) ? tracklistTrack(state, ids[i]) : NULL;
+  }
+  releaseNearTracks(state);
+  memcpy(state->nearTracks, tracks, sizeof(tracks));
+  memcpy(state->nearTrackIds, ids, sizeof(ids));
+}
+
+
+static void releasePrefetchTrack(struct state *state) {
+  if (NULL != state->prefetchTrack) {
+    sp_track_release(state->prefetchTrack);
+    state->prefetchTrack = NULL;
+  }
+  state->prefetchTrackId = -1;
+}
+
+
+static void prefetch_next_track(evutil_socket_t socket,
+                                short what,
+                                void *userdata) {
+  struct state *state = userdata;
+  int next = state->shuffle ? shuffle_peek(&state->shuffleOrder) : playqueue_pos(&state->tracklist) + 1;
+  void *item = playqueue_at(&state->tracklist, next);
+
+  if (NULL == item || ITEM_TRACK(item) == state->prefetchTrackId) {
+    return ;
+  }
+  log_debug("prefetching track %d", next);
+  releasePrefetchTrack(state);
+  state->prefetchTrack = tracklistTrack(state, ITEM_TRACK(item));
+  if (NULL == state->prefetchTrack) {
+    return ;
+  }
+  state->prefetchTrackId = ITEM_TRACK(item);
+  if (sp_track_is_loaded(state->prefetchTrack)) {
+    sp_session_player_prefetch(state->session, state->prefetchTrack);
+  }
+}
+
+
+/*
+ * Forgets about the current track. The player is left loaded when moving on
+ * at end of track, so that the next sp_session_player_load() follows it
+ * without a gap.
+ */
+static void releaseCurrentTrack(struct state *state, int unloadPlayer) {
+  if (NULL == state->currentTrack) {
+    return ;
+  }
+  evtimer_del(state->prefetch);
+  if (unloadPlayer) {
+    // skipping: drop what is queued so the next track is heard right away
+    sp_session_player_unload(state->session);
+    audio_fifo_flush(&state->audiofifo);
+  }
+  sp_track_release(state->currentTrack);
+  state->currentTrack = NULL;
+  state->currentTrackPlaying = 0;
+}
+
+
+
+/*
+ * Plays the current track of the tracklist, stopping the one playing if needed.
+ */
+static void playTrack(struct state *state) {
+  // here we assume that everything about the current track (if any) that
+  // had to be unloaded has been unloaded.
+
+
+  log_debug("playtrack. position %d", playqueue_pos(&state->tracklist));
+
+  releaseCurrentTrack(state, 1);
+
+  void *item = playqueue_current(&state->tracklist);
+  if (NULL == item) {
+    if (NULL != state->uriLoads || state->daemon) {
+      // tracklistFill will call us again when more tracks are in
+      log_info("Waiting for more tracks to be resolved");
+      state->waitingForTracks = 1;
+      return ;
+    }
+    log_info("No more tracks to play");
+    state->exitStatus = EXIT_SUCCESS;
+    sp_session_logout(state->session);
+    return ;
+  }
+
+  state->currentTrackId = ITEM_TRACK(item);
+  state->currentTrack = tracklistTrack(state, state->currentTrackId);
+  if (state->currentTrackId == state->prefetchTrackId) {
+    releasePrefetchTrack(state);
+  }
+  if (NULL == state->currentTrack) {
+    log_warn("no track for %s", track_store_uri(&state->trackStore, state->currentTrackId));
+    skipUnplayable(state);
+    return ;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &state->trackLoadStart);
+
+  keepNearTracks(state);
+
+  if (sp_track_is_loaded(state->currentTrack))
+  {
+     log_debug("track is loaded !");
+     launchPlayCurrentTrack(state);
+  }
+  else
+  {
+     log_debug("track is not loaded :(");
+  }
+}
+
+
+/**
+ * Called when the first tracks are in the tracklist (all of them with -a) and
+ * we can begin playing music. The tracklist keeps filling in the background.
+ */
+static void letsPlay(struct state *state) {
+  stdin_setup(state);
+  state->playbackStarted = 1;
+
+  log_info("Will now begin playback, %.1f ms after login. %d tracks in tracklist so far",
+           msSince(&state->tracklistFillStart), playqueue_len(&state->tracklist));
+  playqueue_jump(&state->tracklist, 0);
+  if (state->shuffle) {
+    shuffleStart(state);
+  }
+  playTrack(state);
+}
+
+
+static void tracklistPrint(struct state *state) {
+  log_info("%d tracks in tracklist", playqueue_len(&state->tracklist));
+  for (int i=0; i<playqueue_len(&state->tracklist); ++i) {
+    int id = ITEM_TRACK(playqueue_at(&state->tracklist, i));
+    log_info(" [%d] \"%s\" (\"%s\" // \"%s\")", i, track_store_name(&state->trackStore, id),
+             track_store_album(&state->trackStore, id), track_store_artist(&state->trackStore, id));
+    fflush(stderr);
+  }
+}
+
+/**
+ * Called in main thread after end_of_track has been called in the music delivery internal thread.
+ */
+static void process_end_of_track(evutil_socket_t socket,
+                                 short what,
+                                 void *userdata) {
+  struct state *state = userdata;
+  releaseCurrentTrack(state, 0);
+  __atomic_store_n(&state->boundaryPending, 1, __ATOMIC_RELEASE);
+  tracklistStep(state, 0);
+  playTrack(state);
+}
+
+
+/**
+ * Inserts track at pos in the tracklist, if it can be played. When shuffling,
+ * it gets played after more tracks after the current one, or at random with
+ * a negative after.
+ */
+static void tracklistAddTrack(struct state* state, int pos, int after, sp_track* track) {
+  log_debug("Adding track \"%s\" to tracklist", sp_track_name(track));
+
+  if (SP_TRACK_AVAILABILITY_AVAILABLE == sp_track_get_availability (state->session, track))
+  {
+    // keep what status and listings need, and let libspotify drop the rest
+    char uri[256];
+    sp_link *l = sp_link_create_from_track(track, 0);
+    if (NULL == l || sp_link_as_string(l, uri, sizeof(uri)) >= sizeof(uri)) {
+      log_warn("Track %s has no uri", sp_track_name(track));
+      if (NULL != l) {
+        sp_link_release(l);
+      }
+      return ;
+    }
+    sp_link_release(l);
+    sp_album *album = sp_track_album(track);
+    sp_artist *artist = (NULL != album) ? sp_album_artist(album) : NULL;
+    int id = track_store_add(&state->trackStore, uri, sp_track_name(track),
+                             (NULL != album) ? sp_album_name(album) : "",
+                             (NULL != artist) ? sp_artist_name(artist) : "",
+                             sp_track_duration(track));
+    if (0 != search_index_add(&state->search, id, track_store_name(&state->trackStore, id),
+                              track_store_album(&state->trackStore, id),
+                              track_store_artist(&state->trackStore, id))) {
+      log_warn("Track %s could not be indexed for search", uri);
+    }
+    if (id >= state->trackNodesSize) {
+      int size = state->trackNodesSize ? 2 * state->trackNodesSize : 256;
+      struct playqueue_node **nodes = realloc(state->trackNodes, size * sizeof(*nodes));
+      if (NULL == nodes) {
+        log_error("Unable to grow the tracklist to %d tracks, dying", size);
+        exit(1);
+      }
+      state->trackNodes = nodes;
+      state->trackNodesSize = size;
+    }
+    state->trackNodes[id] = playqueue_insert(&state->tracklist, pos, TRACK_ITEM(id));
+    state->tracklistKey = 0;
+    if (state->shuffle && state->playbackStarted) {
+      shuffle_insert(&state->shuffleOrder, pos, after);
+    }
+    timeline_mark(TIMELINE_FIRST_TRACK);
+  }
+  else {
+    log_warn("Track %s not available", sp_track_name(track));
+  }
+}
+
+
+/**
+ * Keeps a reference on each of the resolved tracks of a uri, until it is its
+ * turn to go into the tracklist.
+ */
+static void uriLoadSetTracks(struct uriLoad *load, int nbTracks) {
+  load->tracks = malloc(nbTracks * sizeof(sp_track*));
+  load->nbTracks = 0;
+}
+
+
+static void uriLoadAddTrack(struct uriLoad *load, sp_track *track) {
+  sp_track_add_ref(track);
+  load->tracks[load->nbTracks++] = track;
+}
+
+
+/**
+ * Called when an asynchronous uri resolution is over, successfully or not.
+ * The caller then runs tracklistFill() to move on.
+ */
+static void uriLoadDone(struct uriLoad *load) {
+  load->done = 1;
+  load->state->tracklistInFlight--;
+}
+
+
+/**
+ * Marks a uri as being resolved asynchronously. Revalidations do not take a
+ * slot of the tracklist window.
+ */
+static void uriLoadWait(struct uriLoad *load) {
+  load->done = 0;
+  if (!load->revalidate) {
+    load->state->tracklistInFlight++;
+  }
+}
+
+
+static void uriLoadFree(struct uriLoad *load) {
+  for (int i=0; i<load->nbTracks; ++i) {
+    sp_track_release(load->tracks[i]);
+  }
+  free(load->tracks);
+  free(load->uri);
+  free(load);
+}
+
+
+/**
+ * End of an asynchronous album or playlist resolution.
+ */
+static void uriLoadFinished(struct uriLoad *load) {
+  struct state *state = load->state;
+  if (load->revalidate) {
+    uriLoadFree(load);
+    if (--state->revalidations == 0 && NULL == state->uriLoads) {
+      uri_index_commit(&state->uriIndex);
+    }
+    return ;
+  }
+  uriLoadDone(load);
+  tracklistFill(state);
+}
+
+
+/**
+ * Records the resolved tracks of an album or a playlist in the index, for the
+ * next time the same uri is asked for.
+ */
+static void uriLoadIndex(struct uriLoad *load) {
+  struct state *state = load->state;
+  const struct uri_index_entry *e = uri_index_lookup(&state->uriIndex, load->uri);
+  const char **uris = malloc((load->nbTracks ? load->nbTracks : 1) * sizeof(char*));
+  int changed = (NULL == e || e->ntracks != load->nbTracks);
+  int n = 0;
+  char buf[256];
+
+  for (int i=0; i<load->nbTracks; ++i) {
+    sp_link *l = sp_link_create_from_track(load->tracks[i], 0);
+    if (NULL == l) {
+      continue;
+    }
+    int len = sp_link_as_string(l, buf, sizeof(buf));
+    sp_link_release(l);
+    if (len < 0 || len >= (int)sizeof(buf)) {
+      // cut short, it would name another track or none
+      log_warn("Track %d of \"%s\" has a uri too long to index", i, load->uri);
+      changed = 1;
+      continue;
+    }
+    if (!changed && strcmp(buf, uri_index_track(&state->uriIndex, e, n))) {
+      changed = 1;
+    }
+    uris[n++] = strdup(buf);
+  }
+  if (load->revalidate && changed) {
+    log_info("\"%s\" changed since it was indexed, the next start will use the new tracks", load->uri);
+  }
+  uri_index_store(&state->uriIndex, load->uri, uris, n);
+  for (int i=0; i<n; ++i) {
+    free((char *)uris[i]);
+  }
+  free(uris);
+}
+
+
+/**
+ * Like playlistReady() for tracks created from the index: resumes where the
+ * previous call stopped.
+ */
+static int uriLoadTracksReady(struct uriLoad *load) {
+  while (load->loadedTracks < load->nbTracks
+         && sp_track_is_loaded(load->tracks[load->loadedTracks])) {
+    load->loadedTracks++;
+  }
+  return load->loadedTracks == load->nbTracks;
+}
+
+
+/**
+ * Builds the tracks of an album or a playlist from the index, without
+ * browsing anything. Returns 0 when the uri is not in the index, or too old.
+ */
+static int uriLoadFromIndex(struct state *state, struct uriLoad *load) {
+  const struct uri_index_entry *e = uri_index_lookup(&state->uriIndex, load->uri);
+  if (NULL == e || time(NULL) - e->resolved_at > URI_INDEX_MAX_AGE) {
+    return 0;
+  }
+  uriLoadSetTracks(load, e->ntracks);
+  for (uint32_t i=0; i<e->ntracks; ++i) {
+    sp_link *l = sp_link_create_from_string(uri_index_track(&state->uriIndex, e, i));
+    if (NULL == l) {
+      continue;
+    }
+    if (SP_LINKTYPE_TRACK == sp_link_type(l)) {
+      uriLoadAddTrack(load, sp_link_as_track(l));
+    }
+    sp_link_release(l);
+  }
+  log_debug("%d tracks of \"%s\" from the index", load->nbTracks, load->uri);
+  load->fromIndex = 1;
+  if (!uriLoadTracksReady(load)) {
+    // picked up by metadata_updated
+    uriLoadWait(load);
+  }
+  return 1;
+}
+
+
+/**
+ * Callback called when album information has been loaded. If it has been, then all tracks have been.
+ */
+void trackListAddAlbumAlbumBrowseCb(sp_albumbrowse *result, void *userdata) {
+  struct uriLoad *load = userdata;
+  if (SP_ERROR_OK != sp_albumbrowse_error(result)) {
+    log_warn("Could not browse album \"%s\": %s, skipping", load->uri, sp_error_message(sp_albumbrowse_error(result)));
+  }
+  else {
+    log_debug("%d tracks in the album \"%s\"", sp_albumbrowse_num_tracks(result), sp_album_name(sp_albumbrowse_album(result)));
+    uriLoadSetTracks(load, sp_albumbrowse_num_tracks(result));
+    for (int i=0; i < sp_albumbrowse_num_tracks(result); ++i) {
+      uriLoadAddTrack(load, sp_albumbrowse_track(result, i));
+    }
+    uriLoadIndex(load);
+  }
+  sp_albumbrowse_release(load->albumBrowse);
+  load->albumBrowse = NULL;
+  uriLoadFinished(load);
+}
+
+
+/**
+ * A playlist can be used once it is loaded, and all of its tracks too.
+ * Tracks do not get unloaded, so each call resumes where the previous one
+ * stopped: checking a whole playlist costs O(n) over all the callbacks.
+ */
+static int playlistReady(struct uriLoad *load, sp_playlist *pl) {
+  if (!sp_playlist_is_loaded(pl)) {
+    return 0;
+  }
+  int n = sp_playlist_num_tracks(pl);
+  while (load->loadedTracks < n
+         && sp_track_is_loaded(sp_playlist_track(pl, load->loadedTracks))) {
+    load->loadedTracks++;
+  }
+  if (load->loadedTracks < n) {
+    log_debug("%d/%d tracks of playlist loaded", load->loadedTracks, n);
+    return 0;
+  }
+  return 1;
+}
+
+
+static void uriLoadTakePlaylist(struct uriLoad *load, sp_playlist *pl) {
+  uriLoadSetTracks(load, sp_playlist_num_tracks(pl));
+  for (int i=0; i<sp_playlist_num_tracks(pl); ++i) {
+    uriLoadAddTrack(load, sp_playlist_track(pl, i));
+  }
+  uriLoadIndex(load);
+}
+
+
+/**
+ * Callback used when loading playlists
+ */
+static void playlist_metadata_updated(sp_playlist *pl, void *userdata) {
+  struct uriLoad *load = userdata;
+  struct state *state = load->state;
+  log_debug("playlist metadata updated");
+  if (!playlistReady(load, pl)) {
+    log_debug("playlist or some of its tracks still not loaded. wait.");
+    return ;
+  }
+  log_debug("playlist is loaded, and all of its tracks.");
+  uriLoadTakePlaylist(load, pl);
+  sp_playlist_remove_callbacks(pl, state->playlistCallbacks, load);
+  sp_playlist_release(load->playlist);
+  load->playlist = NULL;
+  uriLoadFinished(load);
+}
+
+
+static void tracklistStartUri(struct state* state, struct uriLoad *load);
+
+
+/**
+ * Resolves an album or a playlist again in the background, after it was
+ * taken from the index, so that the next start sees its current tracks.
+ */
+static void uriLoadRevalidate(struct state *state, const char *uri) {
+  struct uriLoad *load = calloc(1, sizeof(struct uriLoad));
+  load->uri = strdup(uri);
+  load->revalidate = 1;
+  tracklistStartUri(state, load);
+  if (load->done) {
+    uriLoadFree(load);
+  }
+  else {
+    state->revalidations++;
+  }
+}
+
+
+/**
+ * Starts resolving a uri into tracks. Whatever cannot be resolved right away
+ * is counted in state->tracklistInFlight until its callback comes.
+ */
+static void tracklistStartUri(struct state* state, struct uriLoad *load) {
+  log_debug("add uri \"%s\"", load->uri);
+
+  load->state = state;
+  load->done = 1;
+  sp_link* l = sp_link_create_from_string(load->uri);
+  if (NULL == l) {
+    log_warn("Could not parse uri \"%s\", skipping", load->uri);
+    return ;
+  }
+  sp_linktype type = sp_link_type(l);
+  if ((SP_LINKTYPE_ALBUM == type || SP_LINKTYPE_PLAYLIST == type)
+      && !load->revalidate && uriLoadFromIndex(state, load)) {
+    sp_link_release(l);
+    uriLoadRevalidate(state, load->uri);
+    return ;
+  }
+  switch (type) {
+    case SP_LINKTYPE_TRACK: {
+      sp_track *track = sp_link_as_track(l);
+      if (sp_track_is_loaded(track)) {
+        uriLoadSetTracks(load, 1);
+        uriLoadAddTrack(load, track);
+      }
+      else {
+        // picked up by metadata_updated
+        sp_track_add_ref(track);
+        load->track = track;
+        load->done = 0;
+        state->tracklistInFlight++;
+      }
+      break;
+    }
+    case SP_LINKTYPE_ALBUM:
+      uriLoadWait(load);
+      load->albumBrowse = sp_albumbrowse_create(state->session, sp_link_as_album(l), &trackListAddAlbumAlbumBrowseCb, load);
+      break;
+    case SP_LINKTYPE_PLAYLIST: {
+      sp_playlist* pl = sp_playlist_create(state->session, l);
+      if (playlistReady(load, pl)) {
+        uriLoadTakePlaylist(load, pl);
+        sp_playlist_release(pl);
+      }
+      else {
+        uriLoadWait(load);
+        load->playlist = pl;
+        sp_playlist_add_callbacks(pl, state->playlistCallbacks, load);
+      }
+      break;
+    }
+    default:
+      log_warn("Unhandled link type \"%s\", skipping", load->uri);
+      break;
+  }
+  sp_link_release(l);
+  l = NULL;
+}
+
+
+/**
+ * Called on metadata updates while uris are being resolved, to pick up the
+ * single tracks, and the tracks taken from the index, that were not loaded
+ * yet.
+ */
+static void tracklistCheckTracks(struct state *state) {
+  int loaded = 0;
+  for (int i = state->tracklistCommitIdx; i < state->tracklistStartIdx; ++i) {
+    struct uriLoad *load = state->uriLoads[i];
+    if (NULL != load->track && sp_track_is_loaded(load->track)) {
+      uriLoadSetTracks(load, 1);
+      uriLoadAddTrack(load, load->track);
+      sp_track_release(load->track);
+      load->track = NULL;
+      uriLoadDone(load);
+      loaded = 1;
+    }
+    else if (load->fromIndex && !load->done && uriLoadTracksReady(load)) {
+      uriLoadDone(load);
+      loaded = 1;
+    }
+  }
+  if (loaded) {
+    tracklistFill(state);
+  }
+}
+
+
+/**
+ * Queues a uri for resolution; tracklistFill() starts it when the window
+ * allows.
+ */
+static void tracklistEnqueueUri(struct state *state, const char *uri, int playNext) {
+  if (NULL == state->uriLoads) {
+    state->nbUriLoads = 0;
+    state->uriLoadsCap = 0;
+    state->tracklistStartIdx = 0;
+    state->tracklistCommitIdx = 0;
+    clock_gettime(CLOCK_MONOTONIC, &state->tracklistFillStart);
+  }
+  if (state->nbUriLoads == state->uriLoadsCap) {
+    state->uriLoadsCap = state->uriLoadsCap ? 2 * state->uriLoadsCap : 16;
+    state->uriLoads = realloc(state->uriLoads, state->uriLoadsCap * sizeof(struct uriLoad*));
   }
+  struct uriLoad *load = calloc(1, sizeof(struct uriLoad));
+  load->state = state;
+  load->uri = strdup(uri);
+  load->playNext = playNext;
+  state->uriLoads[state->nbUriLoads++] = load;
 }
 
 
+/**
+ * Stops playback and empties the tracklist. Uris still being resolved will
+ * not make it into the new one, and those not started yet never will be.
+ */
+static void tracklistClear(struct state *state) {
+  releaseCurrentTrack(state, 1);
+  releasePrefetchTrack(state);
+  releaseNearTracks(state);
+  playqueue_clear(&state->tracklist, NULL);
+  state->tracklistKey = 0;
+  track_store_clear(&state->trackStore);
+  search_index_clear(&state->search);
+  shuffle_reset(&state->shuffleOrder, 0, 0);
+  for (int i = state->tracklistCommitIdx; NULL != state->uriLoads && i < state->nbUriLoads; ++i) {
+    state->uriLoads[i]->discard = 1;
+  }
+  state->playbackStarted = 0;
+  state->waitingForTracks = 0;
+}
+
 
 /*
- * Plays the track at index currentTrackIdx, stopping the current one if needed.
+ * For each uri, if it is a track, add it to the tracklist, if it is an album or a playlist,
+ * add all its tracks to the tracklist.
+ * Up to state->tracklistWindow uris are resolved at the same time; they get
+ * into the tracklist in command line order regardless of which one finishes
+ * first.
  */
-static void playTrack(struct state *state) {
-  // here we assume that everything about the current track (if any) that
-  // had to be unloaded has been unloaded.
+static void tracklistFill(struct state *state) {
+  log_debug("trackListFill");
+  if (NULL == state->uriLoads) {
+    return ;
+  }
 
+  while (state->tracklistInFlight < state->tracklistWindow
+         && state->tracklistStartIdx < state->nbUriLoads) {
+    struct uriLoad *load = state->uriLoads[state->tracklistStartIdx++];
+    if (load->discard) {
+      // replaced before it got its turn, no need to resolve it
+      load->done = 1;
+      continue;
+    }
+    tracklistStartUri(state, load);
+  }
 
-  fprintf(stderr, "playtrack. state->currentTrackIdx=%d\n", state->currentTrackIdx);
+  while (state->tracklistCommitIdx < state->tracklistStartIdx
+         && state->uriLoads[state->tracklistCommitIdx]->done) {
+    struct uriLoad *load = state->uriLoads[state->tracklistCommitIdx++];
+    // "play next" uris go right after the current track, in their order
+    int pos = load->playNext ? playqueue_pos(&state->tracklist) + 1 : playqueue_len(&state->tracklist);
+    for (int i=0, added=0; i<load->nbTracks && !load->discard; ++i) {
+      int len = playqueue_len(&state->tracklist);
+      tracklistAddTrack(state, pos, load->playNext ? added : -1, load->tracks[i]);
+      added += playqueue_len(&state->tracklist) - len;
+      pos += playqueue_len(&state->tracklist) - len;
+    }
+    uriLoadFree(load);
+  }
 
-  if (NULL != state->currentTrack) {
-    sp_session_player_unload(state->session);
-    sp_track_release(state->currentTrack);
-    state->currentTrack = NULL;
-    state->currentTrackPlaying = 0;
+  int resolved = (state->tracklistCommitIdx == state->nbUriLoads);
+  if (resolved) {
+    timeline_mark(TIMELINE_RESOLVED);
+    search_index_sort(&state->search);
+    uri_index_commit(&state->uriIndex);
+    log_info("Resolved %d uris into %d tracks in %.1f ms (window %d)",
+             state->nbUriLoads, playqueue_len(&state->tracklist), msSince(&state->tracklistFillStart),
+             state->tracklistWindow);
+    free(state->uriLoads);
+    state->uriLoads = NULL;
+    state->nbUriLoads = 0;
+    tracklistPrint(state);
   }
 
-  if (state->currentTrackIdx >= state->tracklistLen) {
-    fprintf(stderr, "No more tracks to play\n");
-    sp_session_logout(state->session);
-    return ;
+  if (!state->playbackStarted) {
+    // shuffling needs every track
+    if (resolved || (playqueue_len(&state->tracklist) > 0 && !state->waitForTracklist && !state->shuffle)) {
+      letsPlay(state);
+    }
+  }
+  else if (state->waitingForTracks
+           && (resolved || NULL != playqueue_current(&state->tracklist))) {
+    state->waitingForTracks = 0;
+    playTrack(state);
   }
+}
 
-  state->currentTrack = state->tracklist[state->currentTrackIdx];
-  sp_track_add_ref(state->currentTrack);
 
-  if (sp_track_is_loaded(state->currentTrack))
-  {
-     fprintf(stderr, "track is loaded !\n");
-     launchPlayCurrentTrack(state);
+static void http_reply_ok(struct evhttp_request *req) {
+  struct evbuffer *buf = evbuffer_new();
+  evbuffer_add_printf(buf, "ok\n");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf);
+  evbuffer_free(buf);
+}
+
+
+/**
+ * Reads the integer query parameter name into value. Returns 1, after
+ * replying, if it is missing.
+ */
+static int http_int_param(struct evhttp_request *req, const char *name, int *value) {
+  struct evkeyvalq params;
+  const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+  const char *v = NULL;
+  char *end;
+  if (NULL != query && 0 == evhttp_parse_query_str(query, &params)) {
+    v = evhttp_find_header(&params, name);
+    if (NULL != v) {
+      *value = strtol(v, &end, 10);
+      if (end == v || '\0' != *end) {
+        v = NULL;
+      }
+    }
+    evhttp_clear_headers(&params);
   }
-  else
-  {
-     fprintf(stderr, "track is not loaded :(\n");
+  if (NULL == v) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "missing or invalid number parameter");
+    return 1;
   }
+  return 0;
 }
 
 
 /**
- * Called when tracklist is full and we can begin playing music
+ * /play?uri=... replaces the tracklist, /enqueue?uri=... appends to it, or
+ * inserts after the current track with next=1.
  */
-static void letsPlay(struct state *state) {
-  stdin_setup(state);
+static void http_queue_uri(struct evhttp_request *req, struct state *state, int replace) {
+  struct evkeyvalq params;
+  const char *query = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+  if (NULL == query || 0 != evhttp_parse_query_str(query, &params)) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "missing uri parameter");
+    return ;
+  }
+  const char *uri = evhttp_find_header(&params, "uri");
+  if (NULL == uri) {
+    evhttp_clear_headers(&params);
+    evhttp_send_error(req, HTTP_BADREQUEST, "missing uri parameter");
+    return ;
+  }
 
-  fprintf(stderr, "Will now begin playback. %d tracks in tracklist\n", state->tracklistLen);
-  for (int i=0; i<state->tracklistLen; ++i) {
-    sp_track *t = state->tracklist[i];
-    fprintf(stderr, " [%d] \"%s\" (\"%s\" // \"%s\")\n", i, sp_track_name(t), sp_album_name(sp_track_album(t)), sp_artist_name(sp_album_artist(sp_track_album(t))));
-    fflush(stderr);
+  const char *next = evhttp_find_header(&params, "next");
+  int playNext = !replace && NULL != next && !strcmp(next, "1");
+  log_info("http: %s \"%s\"", replace ? "play" : playNext ? "play next" : "enqueue", uri);
+  if (replace) {
+    tracklistClear(state);
   }
-  state->currentTrackIdx = 0;
-  playTrack(state);
+  tracklistEnqueueUri(state, uri, playNext);
+  evhttp_clear_headers(&params);
+  tracklistFill(state);
+  http_reply_ok(req);
 }
 
+
 /**
- * Called in main thread after end_of_track has been called in the music delivery internal thread.
+ * The q parameter of the request, copied into query; 0 when there is none.
  */
-static void process_end_of_track(evutil_socket_t socket,
-                                 short what,
-                                 void *userdata) {
-  struct state *state = userdata;
-  state->currentTrackIdx++;
-  playTrack(state);
+static int http_query_param(struct evhttp_request *req, char *query, size_t size) {
+  struct evkeyvalq params;
+  const char *q = NULL;
+  const char *s = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+  if (NULL != s && 0 == evhttp_parse_query_str(s, &params)) {
+    q = evhttp_find_header(&params, "q");
+    if (NULL != q) {
+      snprintf(query, size, "%s", q);
+    }
+    evhttp_clear_headers(&params);
+  }
+  return NULL != q;
 }
 
 
-static void tracklistAddTrack(struct state* state, sp_track* track) {
-  sp_track_add_ref(track);
-  if (!sp_track_is_loaded(track)) {
-    fprintf(stderr, "Trying to add a track not loaded yet.\n");
-    // can only happen if adding a single track. When adding tracks from
-    // playlists or albums, they have been loaded.
-    state->tracklistSomethingLoading = 1;
-    state->tracklistCurrentlyLoadingTrack = track;
-  }
-  else {
-    fprintf(stderr, "Adding track \"%s\" to tracklist\n", sp_track_name(track));
-
-    if (SP_TRACK_AVAILABILITY_AVAILABLE == sp_track_get_availability (state->session, track))
-    {
-      state->tracklistLen++;
-      state->tracklist = realloc(state->tracklist, state->tracklistLen * sizeof(sp_track*));
-      state->tracklist[state->tracklistLen-1] = track;
+/**
+ * /play?q=... jumps to a track of the tracklist by name instead.
+ */
+static void http_play(struct evhttp_request *req, void *userdata) {
+  char query[256];
+  if (http_query_param(req, query, sizeof(query))) {
+    if (0 == tracklistPlayQuery(userdata, query)) {
+      http_reply_ok(req);
     }
     else {
-      fprintf(stderr, "Track %s not available\n", sp_track_name(track));
-      sp_track_release(track);
+      evhttp_send_error(req, HTTP_NOTFOUND, "no track matches");
     }
+    return ;
   }
+  http_queue_uri(req, userdata, 1);
 }
 
 
+static void http_find(struct evhttp_request *req, void *userdata) {
+  char query[256];
+  if (!http_query_param(req, query, sizeof(query))) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "missing q parameter");
+    return ;
+  }
+  struct evbuffer *buf = evbuffer_new();
+  findFormat(userdata, query, buf);
+  evhttp_send_reply(req, HTTP_OK, "OK", buf);
+  evbuffer_free(buf);
+}
 
-/**
- * Callback called when album information has been loaded. If it has been, then all tracks have been.
- */
-void trackListAddAlbumAlbumBrowseCb(sp_albumbrowse *result, void *userdata) {
-  struct state *state = userdata;
-  if (result != state->tracklistCurrentlyLoadingAlbumBrowse) {
-    fprintf(stderr, "ERR: result != state->currentlyLoadingAlbumBrowse");
+
+static void http_enqueue(struct evhttp_request *req, void *userdata) {
+  http_queue_uri(req, userdata, 0);
+}
+
+
+static void http_next(struct evhttp_request *req, void *userdata) {
+  playNext(userdata);
+  http_reply_ok(req);
+}
+
+
+static void http_prev(struct evhttp_request *req, void *userdata) {
+  playPrev(userdata);
+  http_reply_ok(req);
+}
+
+
+static void http_pause(struct evhttp_request *req, void *userdata) {
+  togglePause(userdata);
+  http_reply_ok(req);
+}
+
+
+static void http_shuffle(struct evhttp_request *req, void *userdata) {
+  toggleShuffle(userdata);
+  http_reply_ok(req);
+}
+
+
+static void http_jump(struct evhttp_request *req, void *userdata) {
+  int pos;
+  if (0 != http_int_param(req, "pos", &pos)) {
     return ;
   }
-  fprintf(stderr, "%d tracks in the album \"%s\"\n", sp_albumbrowse_num_tracks(result), sp_album_name(sp_albumbrowse_album(result)));
-  for (int i=0; i < sp_albumbrowse_num_tracks(result); ++i) {
-    tracklistAddTrack(state, sp_albumbrowse_track(result, i));
+  if (0 != tracklistJump(userdata, pos)) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "no track at that position");
+    return ;
   }
-  sp_albumbrowse_release(state->tracklistCurrentlyLoadingAlbumBrowse);
-  state->tracklistCurrentlyLoadingAlbumBrowse = NULL;
+  http_reply_ok(req);
+}
 
-  state->tracklistSomethingLoading = 0;
-  (state->tracklistLoadingIdx)++;
-  tracklistFill(state);
+
+static void http_remove(struct evhttp_request *req, void *userdata) {
+  int pos;
+  if (0 != http_int_param(req, "pos", &pos)) {
+    return ;
+  }
+  if (0 != tracklistRemove(userdata, pos)) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "no track at that position");
+    return ;
+  }
+  http_reply_ok(req);
+}
+
+
+static void http_move(struct evhttp_request *req, void *userdata) {
+  int from, to;
+  if (0 != http_int_param(req, "from", &from) || 0 != http_int_param(req, "to", &to)) {
+    return ;
+  }
+  if (0 != tracklistMove(userdata, from, to)) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "no track at that position");
+    return ;
+  }
+  http_reply_ok(req);
+}
+
+
+static void http_metrics(struct evhttp_request *req, void *userdata) {
+  struct evbuffer *buf = evbuffer_new();
+  metricsFormat(userdata, buf);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "text/plain; version=0.0.4");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf);
+  evbuffer_free(buf);
 }
 
 
-static void tracklistAddAlbum(struct state* state, sp_album* album) {
-  sp_albumbrowse *albumBrowse = sp_albumbrowse_create(state->session, album, &trackListAddAlbumAlbumBrowseCb, state);
-  state->tracklistCurrentlyLoadingAlbumBrowse = albumBrowse;
-  state->tracklistSomethingLoading = 1;
+static void http_status(struct evhttp_request *req, void *userdata) {
+  struct evbuffer *buf = evbuffer_new();
+  statusFormat(userdata, buf);
+  evhttp_send_reply(req, HTTP_OK, "OK", buf);
+  evbuffer_free(buf);
 }
 
 
 /**
- * Assumes playlist is loaded. If it is, we know all tracks are.
+ * Control API for daemon mode, served on the main event loop so that
+ * handlers can call into libspotify directly. Only listens on localhost.
  */
-static void tracklistDoAddPlaylist(struct state* state, sp_playlist *pl) {
-  for (int i=0; i<sp_playlist_num_tracks(pl); ++i) {
-    tracklistAddTrack(state, sp_playlist_track(pl, i));
+static int http_setup(struct state *state) {
+  state->http = evhttp_new(state->event_base);
+  if (0 != evhttp_bind_socket(state->http, "127.0.0.1", state->httpPort)) {
+    log_error("Could not listen on port %d", state->httpPort);
+    return 1;
   }
+  evhttp_set_cb(state->http, "/play", &http_play, state);
+  evhttp_set_cb(state->http, "/enqueue", &http_enqueue, state);
+  evhttp_set_cb(state->http, "/next", &http_next, state);
+  evhttp_set_cb(state->http, "/prev", &http_prev, state);
+  evhttp_set_cb(state->http, "/pause", &http_pause, state);
+  evhttp_set_cb(state->http, "/shuffle", &http_shuffle, state);
+  evhttp_set_cb(state->http, "/jump", &http_jump, state);
+  evhttp_set_cb(state->http, "/remove", &http_remove, state);
+  evhttp_set_cb(state->http, "/move", &http_move, state);
+  evhttp_set_cb(state->http, "/find", &http_find, state);
+  evhttp_set_cb(state->http, "/status", &http_status, state);
+  evhttp_set_cb(state->http, "/metrics", &http_metrics, state);
+  log_info("Control API listening on 127.0.0.1:%d", state->httpPort);
+  return 0;
 }
 
 
+/// libspotify's thread updates the credentials while zone threads read them
+static pthread_mutex_t credentialsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
 /**
- * Callback used when loading playlists
+ * Reads a line of a credentials file into buf, without its newline. Returns
+ * 0, or 1 when the line does not fit in buf or has no newline, in which case
+ * it is skipped whole, or -1 at the end of the file.
  */
-static void playlist_metadata_updated(sp_playlist *pl, void *userdata) {
-  fprintf(stderr, "playlist metadata updated\n");
-  if (pl != state->tracklistCurrentlyLoadingPlaylist) {
-      fprintf(stderr, "ERR: pl != state->currentlyLoadingPlaylist\n");
-      // TODO something (skip, I guess)
-      return ;
+static int credentialsLine(FILE *f, char *buf, size_t size) {
+  if (NULL == fgets(buf, size, f)) {
+    return -1;
   }
-  if (sp_playlist_is_loaded(pl)) {
-    // wait until all the tracks of the playlist are loaded
-    for (int i=0; i<sp_playlist_num_tracks(pl); ++i) {
-      if (!sp_track_is_loaded(sp_playlist_track(pl, i))) {
-        fprintf(stderr, "not all tracks of playlist are loaded. wait.\n");
-        return ;
-      }
-    }
-    fprintf(stderr, "playlist is loaded, and all of its tracks.\n");
-    tracklistDoAddPlaylist(state, pl);
-    sp_playlist_remove_callbacks(pl, state->playlistCallbacks, state);
-    sp_playlist_release(state->tracklistCurrentlyLoadingPlaylist);
-    state->tracklistCurrentlyLoadingPlaylist = NULL;
-    state->tracklistSomethingLoading = 0;
+  size_t len = strlen(buf);
+  if (len > 0 && '\n' == buf[len - 1]) {
+    buf[len - 1] = '\0';
+    return 0;
   }
-  else {
-    fprintf(stderr, "playlist still not loaded\n");
+  int c;
+  while (EOF != (c = fgetc(f)) && '\n' != c) {
   }
+  return 1;
 }
 
 
-static void tracklistAddPlaylist(struct state* state, sp_link* playlistLink) {
-  sp_playlist* pl = sp_playlist_create(state->session, playlistLink);
-  if (sp_playlist_is_loaded(pl)) {
-    tracklistDoAddPlaylist(state, pl);
+/**
+ * The stored credentials blob of the zone's user, if any; to be freed. The
+ * file holds a user line then a blob line, for each user; entries with a
+ * line cut short are ignored.
+ */
+static char *credentialsLoad(struct state *state) {
+  char path[sizeof(state->settingsLocation) + sizeof(CREDENTIALS_FILE) + 1];
+  char user[256], blob[CREDENTIALS_BLOB_MAX];
+  char *res = NULL;
+  int u, b;
+  snprintf(path, sizeof(path), "%s/%s", state->settingsLocation, CREDENTIALS_FILE);
+  pthread_mutex_lock(&credentialsMutex);
+  FILE *f = fopen(path, "r");
+  while (NULL != f && NULL == res
+         && -1 != (u = credentialsLine(f, user, sizeof(user)))
+         && -1 != (b = credentialsLine(f, blob, sizeof(blob)))) {
+    if (0 == u && 0 == b && !strcmp(user, state->username) && '\0' != blob[0]) {
+      res = strdup(blob);
+    }
   }
-  else {
-    sp_playlist_add_callbacks (pl, state->playlistCallbacks, state);
-    state->tracklistCurrentlyLoadingPlaylist = pl;
-    state->tracklistSomethingLoading = 1;
+  if (NULL != f) {
+    fclose(f);
   }
+  pthread_mutex_unlock(&credentialsMutex);
+  return res;
 }
 
 
 /**
- * Loads a uri and add the associated tracks into the tracklist.
+ * Replaces the stored credentials of the zone's user, or forgets them when
+ * blob is NULL, keeping those of the other users. The file is only ever
+ * readable by us, and is written aside then renamed so that a crash cannot
+ * leave half of it.
  */
-static void tracklistAddUri(struct state* state, const char* uri) {
-  fprintf(stderr, "add uri \"%s\"\n", uri);
-
-  sp_link* l = sp_link_create_from_string(uri);
-  if (NULL == l) {
-    fprintf(stderr, "Could not parse uri \"%s\", skipping\n", uri);
+static void credentialsSave(struct state *state, const char *blob) {
+  char path[sizeof(state->settingsLocation) + sizeof(CREDENTIALS_FILE) + 1];
+  char tmp[sizeof(path) + 4];
+  char user[256], other[CREDENTIALS_BLOB_MAX];
+  int u, b;
+  if (NULL != blob && strlen(blob) >= sizeof(other)) {
+    log_warn("Credentials blob of %zu bytes too long to store", strlen(blob));
+    blob = NULL;
+  }
+  snprintf(path, sizeof(path), "%s/%s", state->settingsLocation, CREDENTIALS_FILE);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  pthread_mutex_lock(&credentialsMutex);
+  mkdir(state->settingsLocation, 0700);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  FILE *f = (fd < 0) ? NULL : fdopen(fd, "w");
+  if (NULL == f) {
+    log_warn("Could not store credentials in %s", tmp);
+    if (fd >= 0) {
+      close(fd);
+    }
+    pthread_mutex_unlock(&credentialsMutex);
     return ;
   }
-  switch (sp_link_type(l)) {
-    case SP_LINKTYPE_TRACK:
-      tracklistAddTrack(state, sp_link_as_track(l));
-      break;
-    case SP_LINKTYPE_ALBUM:
-      tracklistAddAlbum(state, sp_link_as_album(l));
-      break;
-    case SP_LINKTYPE_PLAYLIST:
-      tracklistAddPlaylist(state, l);
-      break;
-    default:
-      fprintf(stderr, "Unhandled link type \"%s\", skipping\n", uri);
-      break;
+  FILE *old = fopen(path, "r");
+  while (NULL != old
+         && -1 != (u = credentialsLine(old, user, sizeof(user)))
+         && -1 != (b = credentialsLine(old, other, sizeof(other)))) {
+    if (0 == u && 0 == b && strcmp(user, state->username)) {
+      fprintf(f, "%s\n%s\n", user, other);
+    }
   }
-  sp_link_release(l);
-  l = NULL;
+  if (NULL != old) {
+    fclose(old);
+  }
+  if (NULL != blob) {
+    fprintf(f, "%s\n%s\n", state->username, blob);
+  }
+  if (0 != fclose(f) || 0 != rename(tmp, path)) {
+    log_warn("Could not store credentials in %s", path);
+    unlink(tmp);
+  }
+  pthread_mutex_unlock(&credentialsMutex);
 }
 
 
-/*
- * For each arg, if it is a track, add it to the tracklist, if it is an album or a playlist,
- * add all its tracks to the tracklist.
- * Before the first call, state->tracklistLoadingIdx should be 0.
+static void credentials_blob_updated(sp_session *session, const char *blob) {
+  log_debug("credentials blob updated");
+  struct state *state = sp_session_userdata(session);
+  credentialsSave(state, blob);
+}
+
+
+/**
+ * Logs in with, in order of preference: our stored credentials blob, the
+ * password, or whatever libspotify remembers for the user. Full
+ * authentication only happens with the password, and it is remembered.
  */
-static void tracklistFill(struct state *state) {
-  fprintf(stderr, "trackListFill\n");
-  for ( ; state->tracklistLoadingIdx < state->nbUrisToPlay; state->tracklistLoadingIdx++) {
-    tracklistAddUri(state, state->urisToPlay[state->tracklistLoadingIdx]);
-    if (state->tracklistSomethingLoading)
-      // asynchronous load
-      break ;
+static int login(struct state *state) {
+  char *blob = credentialsLoad(state);
+  char remembered[256];
+
+  state->loginWithBlob = (NULL != blob);
+  if (NULL != blob) {
+    log_info("logging in as %s with stored credentials", state->username);
+    sp_session_login(state->session, state->username, NULL, 1, blob);
+    free(blob);
+    return 0;
   }
-
-  if (!state->tracklistSomethingLoading) {
-    letsPlay(state);
+  if (NULL != state->password) {
+    log_info("logging in as %s", state->username);
+    sp_session_login(state->session, state->username, state->password, 1, NULL);
+    return 0;
+  }
+  if (sp_session_remembered_user(state->session, remembered, sizeof(remembered)) >= 0
+      && !strcmp(remembered, state->username)
+      && SP_ERROR_OK == sp_session_relogin(state->session)) {
+    log_info("logging in as %s with remembered credentials", state->username);
+    return 0;
   }
+  log_error("No stored credentials for %s, a password is needed", state->username);
+  return 1;
 }
 
 
 static void logged_in(sp_session *session, sp_error error) {
+  struct state *state = sp_session_userdata(session);
+  if (error != SP_ERROR_OK && state->loginWithBlob && NULL != state->password) {
+    log_warn("Stored credentials refused (%s), logging in with the password",
+             sp_error_message(error));
+    credentialsSave(state, NULL);
+    state->loginWithBlob = 0;
+    sp_session_login(session, state->username, state->password, 1, NULL);
+    return;
+  }
   if (error != SP_ERROR_OK) {
-    fprintf(stderr, "%s\n", sp_error_message(error));
-    exit_status = EXIT_FAILURE;
+    log_error("%s", sp_error_message(error));
+    state->exitStatus = EXIT_FAILURE;
     logged_out(session);
     return;
   }
 
-  struct state *state = sp_session_userdata(session);
+  timeline_mark(TIMELINE_LOGGED_IN);
   state->session = session;
-  evsignal_add(state->sigint, NULL);
+  state->loggedIn = 1;
+
+  if (state->daemon && http_setup(state)) {
+    state->exitStatus = EXIT_FAILURE;
+    sp_session_logout(session);
+    return;
+  }
 
+  for (int i=0; i<state->nbUrisToPlay; ++i) {
+    tracklistEnqueueUri(state, state->urisToPlay[i], 0);
+  }
+  if (0 == state->nbUrisToPlay) {
+    // daemon mode: wait for the control API
+    stdin_setup(state);
+  }
   tracklistFill(state);
 }
 
@@ -408,6 +1892,7 @@ static void process_events(evutil_socket_t socket,
 
   do {
     sp_session_process_events(state->session, &timeout);
+    state->processEventsCalls++;
   } while (timeout == 0);
 
   state->next_timeout.tv_sec = timeout / 1000;
@@ -416,7 +1901,7 @@ static void process_events(evutil_socket_t socket,
 }
 
 static void notify_main_thread(sp_session *session) {
-//  fprintf(stderr, "notify_main_thread\n");
+  log_debug("notify_main_thread");
   struct state *state = sp_session_userdata(session);
   event_active(state->async, 0, 1);
 }
@@ -424,68 +1909,61 @@ static void notify_main_thread(sp_session *session) {
 
 static void metadata_updated(sp_session *session) {
   struct state *state = sp_session_userdata(session);
-	fprintf(stderr, "metadata updated.\n");
-  if (NULL == state->currentTrack) {
+	log_debug("metadata updated.");
+  if (NULL != state->uriLoads) {
     // we're still populating tracklist
-    if (NULL != state->tracklistCurrentlyLoadingTrack) {
-        if (sp_track_is_loaded(state->tracklistCurrentlyLoadingTrack)) {
-        tracklistAddTrack(state, state->tracklistCurrentlyLoadingTrack);
-        state->tracklistCurrentlyLoadingTrack = NULL;
-        state->tracklistSomethingLoading = 0;
-        state->tracklistLoadingIdx++;
-        tracklistFill(state);
-      }
-      else {
-        fprintf(stderr, "track not loaded yet\n");
-      }
-    }
-    else {
-      // other reason, we don't care
-    }
+    tracklistCheckTracks(state);
   }
-  else {
+  if (NULL != state->currentTrack) {
   	if (sp_track_is_loaded (state->currentTrack) && !state->currentTrackPlaying)
     {
-      fprintf(stderr, "track loaded. name: %s\n", sp_track_name(state->currentTrack));
+      log_info("track loaded. name: %s", sp_track_name(state->currentTrack));
       launchPlayCurrentTrack(state);
     }
     else {
-		  fprintf(stderr, "track not loaded yet\n");
+		  log_debug("track not loaded yet");
     }
 	}
 }
 
 
 void end_of_track(sp_session *session) {
-  fprintf(stderr, "end_of_track\n");
+  log_debug("end_of_track");
   struct state *state = sp_session_userdata(session);
   event_active(state->endOfTrack, 0, 1);
 }
 
 
 void start_playback(sp_session *session) {
-	fprintf(stderr, "start playback callback\n");
+	log_debug("start playback callback");
 }
 
 
 void stop_playback(sp_session *session) {
-	fprintf(stderr, "stop playback callback\n");
+	log_debug("stop playback callback");
 	
 }
 
 
 void get_audio_buffer_stats(sp_session *session, sp_audio_buffer_stats *stats)
 {
-//	fprintf(stderr, "get_audio_buffer_stats !\n");
+  struct state *state = sp_session_userdata(session);
+  unsigned int stutters = __atomic_load_n(&state->audiofifo.stutters, __ATOMIC_RELAXED);
+
+  // what is queued plus what the output device still has to play
+  stats->samples = audio_fifo_qlen(&state->audiofifo) +
+    __atomic_load_n(&state->audiofifo.dev_delay, __ATOMIC_RELAXED);
+  // libspotify wants the stutters since the previous query
+  stats->stutter = stutters - state->stuttersReported;
+  state->stuttersReported = stutters;
 }
 
 
 static int music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames)
 {
-//	fprintf(stderr, "IN music delivery ! sample rate: %d, channels %d, %d frames\n", format->sample_rate, format->channels, num_frames);
-
-  audio_fifo_t *af = &g_audiofifo;
+  struct state *state = sp_session_userdata(sess);
+  audio_fifo_t *af = &state->audiofifo;
   audio_fifo_data_t *afd;
   size_t s;
 
@@ -493,86 +1971,284 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
     return 0; // Audio discontinuity, do nothing
   }
 
-  pthread_mutex_lock(&af->mutex);
-
-  /* Buffer one second of audio */
-  if (af->qlen > format->sample_rate) {
-    pthread_mutex_unlock(&af->mutex);
+  /* Buffer up to the jitter buffer's current target */
+  if (audio_fifo_qlen(af) > audio_fifo_depth_frames(af, format->sample_rate)
+      || NULL == (afd = audio_chunk_alloc(af))) {
+    __atomic_add_fetch(&af->put_rejects, 1, __ATOMIC_RELAXED);
     return 0;
   }
 
-  s = num_frames * sizeof(int16_t) * format->channels;
+  /* libspotify redelivers whatever we do not consume */
+  if (num_frames * format->channels > AUDIO_CHUNK_SAMPLES) {
+    num_frames = AUDIO_CHUNK_SAMPLES / format->channels;
+  }
 
-  afd = malloc(sizeof(audio_fifo_data_t) + s);
+  s = num_frames * sizeof(int16_t) * format->channels;
   memcpy(afd->samples, frames, s);
 
   afd->nsamples = num_frames;
+  afd->generation = audio_fifo_generation(af);
 
   afd->rate = format->sample_rate;
   afd->channels = format->channels;
 
-  TAILQ_INSERT_TAIL(&af->q, afd, link);
-  af->qlen += num_frames;
+  // what is left to play before this chunk, sampled before the consumer
+  // can possibly dequeue it
+  int queued = audio_fifo_qlen(af) + __atomic_load_n(&af->dev_delay, __ATOMIC_RELAXED);
+
+  // before the consumer can possibly write it out
+  timeline_mark(TIMELINE_FIRST_DELIVERY);
+  if (!audio_put(af, afd)) {
+    audio_chunk_free(af, afd);
+    __atomic_add_fetch(&af->put_rejects, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
 
-  pthread_cond_signal(&af->cond);
-  pthread_mutex_unlock(&af->mutex);
+  if (__atomic_exchange_n(&state->boundaryPending, 0, __ATOMIC_ACQ_REL)) {
+    // what was still queued when the next track arrived; 0 means a gap
+    state->boundaryQueued = queued;
+    if (queued > 0) {
+      state->boundariesGapless++;
+    }
+    else {
+      state->boundariesStarved++;
+    }
+  }
 
   return num_frames;
 }
 
 static void usage() {
-  fprintf(stderr, "Usage: spotify_cmd <spotify_username> <spotify_password> <spotify_uri>\n");
+  int i;
+  char outputs[128];
+
+  log_error("Usage: spotify_cmd [-a] [-b min:target:max] [-c cachedir] [-j] [-o output[:arg]] [-q|-v] [-s] [-w window] <spotify_username> <spotify_password> <spotify_uri> [<spotify_uri> ...] [-- <zone> ...]");
+  log_error("       spotify_cmd -d port [-c cachedir] [-j] [-o output[:arg]] [-q|-v] [-s] [-w window] <spotify_username> <spotify_password> [<spotify_uri> ...] [-- <zone> ...]");
+  log_error("  -a         resolve every uri before starting playback");
+  log_error("  -b min:target:max  audio buffer depth in ms (default %d:%d:%d)",
+            AUDIO_DEPTH_MIN_MS, AUDIO_DEPTH_TARGET_MS, AUDIO_DEPTH_MAX_MS);
+  log_error("  -c cachedir  libspotify cache location (default .cache)");
+  log_error("  -d port    stay logged in and serve the control API on localhost:port");
+  log_error("  -j         print the startup timeline as JSON on stdout");
+  outputs[0] = '\0';
+  for (i = 0; audio_sink_name(i); i++) {
+    strncat(outputs, " ", sizeof(outputs) - strlen(outputs) - 1);
+    strncat(outputs, audio_sink_name(i), sizeof(outputs) - strlen(outputs) - 1);
+  }
+  log_error("  -o output[:arg]  audio output, one of:%s (default %s)", outputs, audio_sink_name(0));
+  log_error("  -q         only log errors");
+  log_error("  -v         log debug messages too");
+  log_error("  -s         shuffle, once every uri is resolved");
+  log_error("  -w window  number of uris resolved concurrently (default 8)");
+  log_error("The password can be - once credentials are stored, in .settings/%s", CREDENTIALS_FILE);
+  log_error("(cachedir/zone<n>/%s for zone n when there are several).", CREDENTIALS_FILE);
+  log_error("Each <zone>, that is username, password and uris, adds a player with its own");
+  log_error("account and output. Zone n then uses cachedir/zone<n> and port+n, and a %%d in");
+  log_error("the output argument becomes n.");
 }
 
 
-static int parse_cmdline(int argc, const char **argv) {
-  if (argc < 4) {
+static int parse_cmdline(int argc, const char **argv, struct options *opts) {
+  int opt;
+
+  opts->tracklistWindow = 8;
+  opts->waitForTracklist = 0;
+  opts->shuffle = 0;
+  opts->daemon = 0;
+  opts->cacheLocation = ".cache";
+  opts->output = NULL;
+  opts->depthMax = 0;
+  // options come first: "--" separates zones
+  while (-1 != (opt = getopt(argc, (char * const *)argv, "+ab:c:d:jo:qsvw:"))) {
+    switch (opt) {
+      case 'a':
+        opts->waitForTracklist = 1;
+        break;
+      case 'b':
+        if (3 != sscanf(optarg, "%d:%d:%d", &opts->depthMin, &opts->depthTarget, &opts->depthMax)) {
+          usage();
+          return -1;
+        }
+        break;
+      case 'c':
+        opts->cacheLocation = optarg;
+        break;
+      case 'j':
+        timeline_json = 1;
+        break;
+      case 'd':
+        opts->daemon = 1;
+        opts->httpPort = atoi(optarg);
+        break;
+      case 'o':
+        opts->output = optarg;
+        break;
+      case 'q':
+        log_level = LOG_LEVEL_ERROR;
+        break;
+      case 's':
+        opts->shuffle = 1;
+        break;
+      case 'v':
+        log_level = LOG_LEVEL_DEBUG;
+        break;
+      case 'w':
+        opts->tracklistWindow = atoi(optarg);
+        break;
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if (opts->tracklistWindow < 1) {
     usage();
-    return 1;
+    return -1;
   }
-  account.username = argv[1];
-  account.password = argv[2];
-  state->nbUrisToPlay = argc - 3;
-  state->urisToPlay = argv + 3;
-  return 0;
+  return optind;
 }
 
 
-int main(int argc, const char **argv) {
+/**
+ * The output spec of a zone: the first %d of the argument is replaced by the
+ * zone number, so that zones can write to different files.
+ */
+static const char *zoneOutput(const char *output, int zone, char *buf, size_t size) {
+  const char *d = (NULL == output) ? NULL : strstr(output, "%d");
+  if (NULL == d) {
+    return output;
+  }
+  snprintf(buf, size, "%.*s%d%s", (int)(d - output), output, zone, d + 2);
+  return buf;
+}
 
-  // Initialize program state
-  state = malloc(sizeof(struct state));
 
-  if (parse_cmdline(argc, argv)) {
-    return 1;
+/**
+ * Sets up a zone from its command line arguments: username, password, then
+ * uris. Nothing runs before zoneRun().
+ */
+static struct state *zoneNew(const struct options *opts, int zone, int nbZones,
+                             int argc, const char **argv) {
+  struct state *state;
+  char output[1024];
+
+  if (argc < (opts->daemon ? 2 : 3)) {
+    usage();
+    return NULL;
+  }
+  // the audio FIFO has cache line aligned members
+  if (0 != posix_memalign((void **)&state, AUDIO_CACHELINE, sizeof(struct state))) {
+    return NULL;
   }
+  memset(state, 0, sizeof(struct state));
+  state->zone = zone;
+  state->exitStatus = EXIT_FAILURE;
 
-  fprintf(stderr, "will play %s\n", state->urisToPlay[0]);
+  state->audioSink = audio_sink_new(zoneOutput(opts->output, zone, output, sizeof(output)));
+  if (NULL == state->audioSink) {
+    log_error("unknown audio output %s", opts->output);
+    usage();
+    free(state);
+    return NULL;
+  }
+  if (0 != opts->depthMax) {
+    audio_fifo_set_depth(&state->audiofifo, opts->depthMin, opts->depthTarget, opts->depthMax);
+  }
 
-  // Initialize libev w/ pthreads
-  evthread_use_pthreads();
+  state->username = argv[0];
+  state->password = strcmp(argv[1], "-") ? argv[1] : NULL;
+  state->nbUrisToPlay = argc - 2;
+  state->urisToPlay = argv + 2;
+
+  state->tracklistWindow = opts->tracklistWindow;
+  state->waitForTracklist = opts->waitForTracklist;
+  state->shuffle = opts->shuffle;
+  state->daemon = opts->daemon;
+  state->httpPort = opts->httpPort + zone;
+  if (nbZones > 1) {
+    snprintf(state->logPrefix, sizeof(state->logPrefix), "zone %d: ", zone);
+    snprintf(state->cacheLocation, sizeof(state->cacheLocation), "%s/zone%d", opts->cacheLocation, zone);
+    // sessions cannot share their settings either
+    snprintf(state->settingsLocation, sizeof(state->settingsLocation), "%s", state->cacheLocation);
+  }
+  else {
+    snprintf(state->cacheLocation, sizeof(state->cacheLocation), "%s", opts->cacheLocation);
+    snprintf(state->settingsLocation, sizeof(state->settingsLocation), ".settings");
+  }
+
+  if (state->nbUrisToPlay > 0) {
+    log_info("%swill play %s", state->logPrefix, state->urisToPlay[0]);
+  }
 
   state->event_base = event_base_new();
   state->async = event_new(state->event_base, -1, 0, &process_events, state);
   state->timer = evtimer_new(state->event_base, &process_events, state);
-  state->sigint = evsignal_new(state->event_base, SIGINT, &sigint_handler, state);
-  state->ev_stdin = event_new(state->event_base, fileno(stdin), EV_READ|EV_PERSIST, &stdin_data, state);
+  state->sigint = event_new(state->event_base, -1, 0, &sigint_handler, state);
+  if (0 == zone) {
+    state->ev_stdin = event_new(state->event_base, fileno(stdin), EV_READ|EV_PERSIST, &stdin_data, state);
+  }
 
+  state->http = NULL;
+  state->paused = 0;
   state->endOfTrack = event_new(state->event_base, -1, 0, &process_end_of_track, state);
+  state->prefetch = evtimer_new(state->event_base, &prefetch_next_track, state);
+  state->boundaryPending = 0;
+  state->boundaryQueued = 0;
+  state->boundariesGapless = 0;
+  state->boundariesStarved = 0;
+  memset(state->trackLoadBuckets, 0, sizeof(state->trackLoadBuckets));
+  state->trackLoads = 0;
+  state->trackLoadSeconds = 0;
+  state->processEventsCalls = 0;
   state->currentTrack = NULL;
+  state->currentTrackId = -1;
   state->currentTrackPlaying = 0;
-  state->currentTrackIdx = 0;
+  state->prefetchTrack = NULL;
+  state->prefetchTrackId = -1;
+  for (int i=0; i<NEAR_TRACKS; ++i) {
+    state->nearTracks[i] = NULL;
+    state->nearTrackIds[i] = -1;
+  }
+
+  playqueue_init(&state->tracklist);
+  track_store_init(&state->trackStore);
+  search_index_init(&state->search);
+  state->trackNodes = NULL;
+  state->trackNodesSize = 0;
+  shuffle_init(&state->shuffleOrder, time(NULL) ^ ((uint64_t)zone << 32));
+  state->unplayableInARow = 0;
+  state->uriLoads = NULL;
+  state->tracklistInFlight = 0;
+  state->tracklistStartIdx = 0;
+  state->tracklistCommitIdx = 0;
+  state->playbackStarted = 0;
+  state->waitingForTracks = 0;
+  state->stuttersReported = 0;
+  return state;
+}
+
+
+/**
+ * Runs a zone until it logs out, in its own thread: its session is created,
+ * and all of its libspotify calls are made, from here.
+ */
+static void *zoneRun(void *userdata) {
+  struct state *state = userdata;
 
-  state->tracklist = NULL;
-  state->tracklistSomethingLoading = 0;
-  state->tracklistLoadingIdx = 0;
-  state->tracklistCurrentlyLoadingAlbumBrowse = NULL;
+  log_set_prefix(state->logPrefix);
+  // an event loop can wait on stderr, unlike the audio and libspotify threads
+  log_set_blocking(1);
 
   sp_playlist_callbacks playlist_callbacks = {
+    .playlist_state_changed = playlist_metadata_updated,
     .playlist_metadata_updated = playlist_metadata_updated,
   };
   state->playlistCallbacks = &playlist_callbacks;
 
+  char indexPath[sizeof(state->cacheLocation) + sizeof(URI_INDEX_FILE) + 1];
+  mkdir(state->cacheLocation, 0700);
+  snprintf(indexPath, sizeof(indexPath), "%s/%s", state->cacheLocation, URI_INDEX_FILE);
+  uri_index_open(&state->uriIndex, indexPath);
+
   // Initialize libspotify
   sp_session_callbacks session_callbacks = {
     .logged_in = &logged_in,
@@ -583,6 +2259,7 @@ int main(int argc, const char **argv) {
     .start_playback = &start_playback,
     .stop_playback = &stop_playback,
     .get_audio_buffer_stats = &get_audio_buffer_stats,
+    .credentials_blob_updated = &credentials_blob_updated,
     .music_delivery = &music_delivery
   };
 
@@ -590,36 +2267,158 @@ int main(int argc, const char **argv) {
     .api_version = SPOTIFY_API_VERSION,
     .application_key = g_appkey,
     .application_key_size = g_appkey_size,
-    .cache_location = ".cache",
+    .cache_location = state->cacheLocation,
     .callbacks = &session_callbacks,
     .compress_playlists = 0,
     .dont_save_metadata_for_playlists = 0,
-    .settings_location = ".settings",
+    .settings_location = state->settingsLocation,
     .user_agent = "spotify_cmd",
     .userdata = state,
   };
 
-  audio_init(&g_audiofifo);
+  audio_init(&state->audiofifo, state->audioSink);
 
   sp_session *session;
   sp_error session_create_error = sp_session_create(&session_config,
                                                     &session);
 
-  if (session_create_error != SP_ERROR_OK)
-    return EXIT_FAILURE;
+  if (session_create_error != SP_ERROR_OK) {
+    // libspotify itself only supports one session per process
+    log_error("Could not create a session: %s", sp_error_message(session_create_error));
+    audio_stop(&state->audiofifo);
+    uri_index_close(&state->uriIndex);
+    return NULL;
+  }
+  timeline_mark(TIMELINE_SESSION_CREATED);
+  // process_events can run before logged_in
+  state->session = session;
 
   // Log in to Spotify
-  printf("username: %s. password: %s\n", account.username, account.password);
-  sp_session_login(session, account.username, account.password, 0, NULL);
+  timeline_mark(TIMELINE_LOGIN);
+  if (0 == login(state)) {
+    event_base_dispatch(state->event_base);
+  }
+
+  // in case no audio ever made it out
+  timeline_report();
+  printStatus(state);
 
-  event_base_dispatch(state->event_base);
+  // no more deliveries once the player is unloaded; the state goes with the zone
+  sp_session_player_unload(session);
+  audio_stop(&state->audiofifo);
+  releaseCurrentTrack(state, 0);
+  releasePrefetchTrack(state);
+  releaseNearTracks(state);
 
   event_free(state->endOfTrack);
+  event_free(state->prefetch);
   event_free(state->async);
   event_free(state->timer);
   if (state->http != NULL) evhttp_free(state->http);
-  event_base_free(state->event_base);
-  free(state);
-  return exit_status;
+  uri_index_close(&state->uriIndex);
+  shuffle_free(&state->shuffleOrder);
+  track_store_clear(&state->trackStore);
+  search_index_clear(&state->search);
+  free(state->trackNodes);
+  return NULL;
+}
+
+
+/// Zones being run, for SIGINT
+static struct state **zones;
+static int nbZones;
+static pthread_mutex_t zonesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * SIGINT is blocked in every thread but this one, which passes it on to the
+ * event loop of each zone.
+ */
+static void *signalWait(void *userdata) {
+  sigset_t *set = userdata;
+  int sig;
+
+  while (0 == sigwait(set, &sig)) {
+    pthread_mutex_lock(&zonesMutex);
+    for (int i=0; i<nbZones; ++i) {
+      event_active(zones[i]->sigint, 0, 1);
+    }
+    pthread_mutex_unlock(&zonesMutex);
+  }
+  return NULL;
+}
+
+
+int main(int argc, const char **argv) {
+  struct options opts;
+  static sigset_t sigint;
+  pthread_t tid;
+  int status = EXIT_SUCCESS;
+
+  // before any other thread starts, so that they all inherit the mask
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+
+  log_init();
+  log_set_blocking(1);
+  timeline_mark(TIMELINE_START);
+
+  int first = parse_cmdline(argc, argv, &opts);
+  if (first < 0) {
+    return 1;
+  }
+
+  // Initialize libev w/ pthreads
+  evthread_use_pthreads();
+
+  // one zone per group of arguments between separators
+  int count = 1;
+  for (int i=first; i<argc; ++i) {
+    count += !strcmp(argv[i], ZONE_SEPARATOR);
+  }
+#ifndef FAKE_SPOTIFY
+  if (count > 1) {
+    log_error("libspotify allows a single session per process: run one spotify_cmd per zone");
+    return 1;
+  }
+#endif
+  zones = calloc(count, sizeof(struct state*));
+  for (int start=first, end=first; nbZones < count; start = ++end) {
+    while (end < argc && strcmp(argv[end], ZONE_SEPARATOR)) {
+      end++;
+    }
+    zones[nbZones] = zoneNew(&opts, nbZones, count, end - start, argv + start);
+    if (NULL == zones[nbZones]) {
+      return 1;
+    }
+    nbZones++;
+  }
+  if (count > 1) {
+    mkdir(opts.cacheLocation, 0700);
+  }
+
+  pthread_create(&tid, NULL, &signalWait, &sigint);
+  pthread_detach(tid);
+
+  for (int i=0; i<nbZones; ++i) {
+    pthread_create(&zones[i]->thread, NULL, &zoneRun, zones[i]);
+  }
+  for (int i=0; i<nbZones; ++i) {
+    pthread_join(zones[i]->thread, NULL);
+    if (EXIT_SUCCESS != zones[i]->exitStatus) {
+      status = EXIT_FAILURE;
+    }
+  }
 
+  pthread_mutex_lock(&zonesMutex);
+  for (int i=0; i<nbZones; ++i) {
+    event_free(zones[i]->sigint);
+    event_base_free(zones[i]->event_base);
+    free(zones[i]);
+  }
+  nbZones = 0;
+  pthread_mutex_unlock(&zonesMutex);
+  free(zones);
+  return status;
 }
@@ -0,0 +1,52 @@
+/*
+ * Null audio output driver: throws the audio away as fast as it comes, for
+ * running the whole pipeline on machines without a sound card.
+ */
+
+#include <limits.h>
+
+#include "audio.h"
+
+
+static int null_open(audio_sink_t *s, int rate, int channels)
+{
+	return 0;
+}
+
+static int null_write(audio_sink_t *s, audio_batch_t *b)
+{
+	audio_batch_fill(b, NULL, INT_MAX);
+	return 0;
+}
+
+static void null_drain(audio_sink_t *s)
+{
+}
+
+static void null_drop(audio_sink_t *s)
+{
+}
+
+static void null_pause(audio_sink_t *s, int paused)
+{
+}
+
+static int null_delay(audio_sink_t *s)
+{
+	return 0;
+}
+
+static void null_close(audio_sink_t *s)
+{
+}
+
+const audio_sink_ops_t audio_sink_null = {
+	.name = "null",
+	.open = null_open,
+	.write = null_write,
+	.drain = null_drain,
+	.drop = null_drop,
+	.pause = null_pause,
+	.delay = null_delay,
+	.close = null_close,
+};
@@ -26,80 +26,161 @@
  */
 
 #include <AudioToolbox/AudioQueue.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include "audio.h"
+#include "log.h"
 
 #define BUFFER_COUNT 7
-static struct AQPlayerState {
+static const int kSampleCountPerBuffer = 2048;
+
+struct osx_out {
     AudioStreamBasicDescription   desc;
     AudioQueueRef                 queue;
     AudioQueueBufferRef           buffers[BUFFER_COUNT];
     unsigned buffer_size;
-} state;
+
+    /* buffers handed back by the queue, ready to be filled again */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    AudioQueueBufferRef free[BUFFER_COUNT];
+    int nfree;
+    int started;
+};
 
 static void audio_callback (void *aux, AudioQueueRef aq, AudioQueueBufferRef bufout)
 {
-    audio_fifo_t *af = aux;
-    audio_fifo_data_t *afd = audio_get(af);
-
-    bufout->mAudioDataByteSize = afd->nsamples * sizeof(short) * afd->channels;
+    struct osx_out *out = aux;
 
-    assert(bufout->mAudioDataByteSize <= state.buffer_size);
-    memcpy(bufout->mAudioData, afd->samples, bufout->mAudioDataByteSize);
-
-    AudioQueueEnqueueBuffer(state.queue, bufout, 0, NULL);
-    free(afd);
+    pthread_mutex_lock(&out->mutex);
+    out->free[out->nfree++] = bufout;
+    pthread_cond_signal(&out->cond);
+    pthread_mutex_unlock(&out->mutex);
 }
 
-static const int kSampleCountPerBuffer = 2048;
-
-void audio_init(audio_fifo_t *af)
+static int osx_open(audio_sink_t *s, int rate, int channels)
 {
+    struct osx_out *out;
     int i;
-    TAILQ_INIT(&af->q);
-    af->qlen = 0;
-
-    pthread_mutex_init(&af->mutex, NULL);
-    pthread_cond_init(&af->cond, NULL);
 
-    bzero(&state, sizeof(state));
+    out = calloc(1, sizeof(*out));
 
-    state.desc.mFormatID = kAudioFormatLinearPCM;
-    state.desc.mFormatFlags = kAudioFormatFlagIsSignedInteger	| kAudioFormatFlagIsPacked;
-    state.desc.mSampleRate = 44100;
-    state.desc.mChannelsPerFrame = 2;
-    state.desc.mFramesPerPacket = 1;
-    state.desc.mBytesPerFrame = sizeof(short) * state.desc.mChannelsPerFrame;
-    state.desc.mBytesPerPacket = state.desc.mBytesPerFrame;
-    state.desc.mBitsPerChannel = (state.desc.mBytesPerFrame*8)/state.desc.mChannelsPerFrame;
-    state.desc.mReserved = 0;
+    out->desc.mFormatID = kAudioFormatLinearPCM;
+    out->desc.mFormatFlags = kAudioFormatFlagIsSignedInteger	| kAudioFormatFlagIsPacked;
+    out->desc.mSampleRate = rate;
+    out->desc.mChannelsPerFrame = channels;
+    out->desc.mFramesPerPacket = 1;
+    out->desc.mBytesPerFrame = sizeof(short) * out->desc.mChannelsPerFrame;
+    out->desc.mBytesPerPacket = out->desc.mBytesPerFrame;
+    out->desc.mBitsPerChannel = (out->desc.mBytesPerFrame*8)/out->desc.mChannelsPerFrame;
+    out->desc.mReserved = 0;
 
-    state.buffer_size = state.desc.mBytesPerFrame * kSampleCountPerBuffer;
+    out->buffer_size = out->desc.mBytesPerFrame * kSampleCountPerBuffer;
 
-    if (noErr != AudioQueueNewOutput(&state.desc, audio_callback, af, NULL, NULL, 0, &state.queue)) {
-	printf("audioqueue error\n");
-	return;
+    if (noErr != AudioQueueNewOutput(&out->desc, audio_callback, out, NULL, NULL, 0, &out->queue)) {
+	log_error("audioqueue error");
+	free(out);
+	return -1;
     }
 
-    // Start some empty playback so we'll get the callbacks that fill in the actual audio.
+    pthread_mutex_init(&out->mutex, NULL);
+    pthread_cond_init(&out->cond, NULL);
     for (i = 0; i < BUFFER_COUNT; ++i) {
-		AudioQueueAllocateBuffer(state.queue, state.buffer_size, &state.buffers[i]);
-		state.buffers[i]->mAudioDataByteSize = state.buffer_size;
-		AudioQueueEnqueueBuffer(state.queue, state.buffers[i], 0, NULL);
+	AudioQueueAllocateBuffer(out->queue, out->buffer_size, &out->buffers[i]);
+	out->free[out->nfree++] = out->buffers[i];
     }
-    if (noErr != AudioQueueStart(state.queue, NULL)) puts("AudioQueueStart failed");
+    s->priv = out;
+    return 0;
 }
 
-void audio_fifo_flush(audio_fifo_t *af)
+static int osx_write(audio_sink_t *s, audio_batch_t *b)
 {
-    audio_fifo_data_t *afd;
+    struct osx_out *out = s->priv;
+    AudioQueueBufferRef buf;
+    int n;
+
+    pthread_mutex_lock(&out->mutex);
+    while (!out->nfree)
+	pthread_cond_wait(&out->cond, &out->mutex);
+    buf = out->free[--out->nfree];
+    pthread_mutex_unlock(&out->mutex);
+
+    n = audio_batch_fill(b, buf->mAudioData, kSampleCountPerBuffer);
+    buf->mAudioDataByteSize = n * out->desc.mBytesPerFrame;
+    AudioQueueEnqueueBuffer(out->queue, buf, 0, NULL);
+
+    /* the queue starts once it has something to play */
+    if (!out->started) {
+	if (noErr != AudioQueueStart(out->queue, NULL)) log_error("AudioQueueStart failed");
+	out->started = 1;
+    }
+    return 0;
+}
 
-    pthread_mutex_lock(&af->mutex);
+static void osx_drain(audio_sink_t *s)
+{
+    struct osx_out *out = s->priv;
+
+    /* let what is enqueued play out, every buffer comes back when done */
+    AudioQueueFlush(out->queue);
+    pthread_mutex_lock(&out->mutex);
+    while (out->started && out->nfree < BUFFER_COUNT)
+	pthread_cond_wait(&out->cond, &out->mutex);
+    pthread_mutex_unlock(&out->mutex);
+    AudioQueueStop(out->queue, true);
+    out->started = 0;
+}
 
-    while((afd = TAILQ_FIRST(&af->q))) {
-		TAILQ_REMOVE(&af->q, afd, link);
-		free(afd);
-    }
+static void osx_drop(audio_sink_t *s)
+{
+    struct osx_out *out = s->priv;
 
-    af->qlen = 0;
-    pthread_mutex_unlock(&af->mutex);
+    /* hands every enqueued buffer back through the callback */
+    AudioQueueReset(out->queue);
 }
+
+static void osx_pause(audio_sink_t *s, int paused)
+{
+    struct osx_out *out = s->priv;
+
+    if (!out->started)
+	return;
+    if (paused)
+	AudioQueuePause(out->queue);
+    else
+	AudioQueueStart(out->queue, NULL);
+}
+
+static int osx_delay(audio_sink_t *s)
+{
+    struct osx_out *out = s->priv;
+    int queued;
+
+    pthread_mutex_lock(&out->mutex);
+    queued = BUFFER_COUNT - out->nfree;
+    pthread_mutex_unlock(&out->mutex);
+    return queued * kSampleCountPerBuffer;
+}
+
+static void osx_close(audio_sink_t *s)
+{
+    struct osx_out *out = s->priv;
+
+    AudioQueueDispose(out->queue, true);
+    pthread_mutex_destroy(&out->mutex);
+    pthread_cond_destroy(&out->cond);
+    free(out);
+    s->priv = NULL;
+}
+
+const audio_sink_ops_t audio_sink_osx = {
+    .name = "osx",
+    .open = osx_open,
+    .write = osx_write,
+    .drain = osx_drain,
+    .drop = osx_drop,
+    .pause = osx_pause,
+    .delay = osx_delay,
+    .close = osx_close,
+};
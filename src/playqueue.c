@@ -0,0 +1,294 @@
+/*
+ * An implicit treap: a binary search tree ordered by position, where a node
+ * only knows the size of its subtree, balanced by random priorities. Insert,
+ * remove and move split the tree at a position and merge the pieces back,
+ * in O(log n) expected time, without ever shifting items around. Nodes also
+ * point to their parent, so that a node finds its own position by walking up.
+ */
+
+#include <stdlib.h>
+
+#include "playqueue.h"
+
+
+struct playqueue_node {
+	struct playqueue_node *left;
+	struct playqueue_node *right;
+	struct playqueue_node *parent; /* stale on the root of a piece being split */
+	void *item;
+	uint32_t prio;
+	int size;
+};
+
+
+static int node_size(struct playqueue_node *n)
+{
+	return n ? n->size : 0;
+}
+
+static void node_update(struct playqueue_node *n)
+{
+	n->size = 1 + node_size(n->left) + node_size(n->right);
+	if (n->left)
+		n->left->parent = n;
+	if (n->right)
+		n->right->parent = n;
+}
+
+/* everything in a comes before everything in b */
+static struct playqueue_node *merge(struct playqueue_node *a, struct playqueue_node *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = merge(a->right, b);
+		node_update(a);
+		return a;
+	}
+	b->left = merge(a, b->left);
+	node_update(b);
+	return b;
+}
+
+/* the first pos nodes of n go to *a, the others to *b */
+static void split(struct playqueue_node *n, int pos,
+		  struct playqueue_node **a, struct playqueue_node **b)
+{
+	if (!n) {
+		*a = *b = NULL;
+		return;
+	}
+	if (node_size(n->left) < pos) {
+		split(n->right, pos - node_size(n->left) - 1, &n->right, b);
+		*a = n;
+	}
+	else {
+		split(n->left, pos, a, &n->left);
+		*b = n;
+	}
+	node_update(n);
+}
+
+static void free_nodes(struct playqueue_node *n, void (*release)(void *))
+{
+	if (!n)
+		return;
+	free_nodes(n->left, release);
+	free_nodes(n->right, release);
+	if (release)
+		release(n->item);
+	free(n);
+}
+
+/* the first position before end, in n put at base, whose item matches */
+static int find_nodes(struct playqueue_node *n, int base, int end,
+		      int (*match)(void *arg, void *item), void *arg)
+{
+	int pos;
+
+	if (!n || base >= end)
+		return -1;
+	if ((pos = find_nodes(n->left, base, end, match, arg)) >= 0)
+		return pos;
+	pos = base + node_size(n->left);
+	if (pos >= end)
+		return -1;
+	if (match(arg, n->item))
+		return pos;
+	return find_nodes(n->right, pos + 1, end, match, arg);
+}
+
+static uint32_t next_prio(playqueue_t *q)
+{
+	/* xorshift32 */
+	q->seed ^= q->seed << 13;
+	q->seed ^= q->seed >> 17;
+	q->seed ^= q->seed << 5;
+	return q->seed;
+}
+
+static void insert_node(playqueue_t *q, int pos, struct playqueue_node *n)
+{
+	struct playqueue_node *a, *b;
+
+	split(q->root, pos, &a, &b);
+	q->root = merge(merge(a, n), b);
+	q->root->parent = NULL;
+}
+
+static struct playqueue_node *remove_node(playqueue_t *q, int pos)
+{
+	struct playqueue_node *a, *b, *n;
+
+	split(q->root, pos, &a, &b);
+	split(b, 1, &n, &b);
+	q->root = merge(a, b);
+	if (q->root)
+		q->root->parent = NULL;
+	return n;
+}
+
+
+void playqueue_init(playqueue_t *q)
+{
+	q->root = NULL;
+	q->cur = 0;
+	q->seed = 2463534242u;
+}
+
+/*
+ * Empties the queue, handing each item to release (if not NULL) first.
+ */
+void playqueue_clear(playqueue_t *q, void (*release)(void *item))
+{
+	free_nodes(q->root, release);
+	q->root = NULL;
+	q->cur = 0;
+}
+
+int playqueue_len(playqueue_t *q)
+{
+	return node_size(q->root);
+}
+
+/*
+ * The item at pos, or NULL if pos is out of range.
+ */
+void* playqueue_at(playqueue_t *q, int pos)
+{
+	struct playqueue_node *n = q->root;
+
+	if (pos < 0 || pos >= node_size(n))
+		return NULL;
+	for (;;) {
+		if (pos < node_size(n->left)) {
+			n = n->left;
+		}
+		else if (pos == node_size(n->left)) {
+			return n->item;
+		}
+		else {
+			pos -= node_size(n->left) + 1;
+			n = n->right;
+		}
+	}
+}
+
+int playqueue_pos(playqueue_t *q)
+{
+	return q->cur;
+}
+
+/*
+ * NULL when the current position is past the end.
+ */
+void* playqueue_current(playqueue_t *q)
+{
+	return playqueue_at(q, q->cur);
+}
+
+/*
+ * Makes pos the current position, clamped to 0..length.
+ */
+void playqueue_jump(playqueue_t *q, int pos)
+{
+	if (pos < 0)
+		pos = 0;
+	if (pos > playqueue_len(q))
+		pos = playqueue_len(q);
+	q->cur = pos;
+}
+
+/*
+ * Inserts item so that it ends up at pos (clamped to 0..length). The current
+ * item stays current; when the position is past the end, an item appended
+ * there becomes the current one. The node returned stays valid, wherever the
+ * item moves, until it is removed.
+ */
+struct playqueue_node* playqueue_insert(playqueue_t *q, int pos, void *item)
+{
+	struct playqueue_node *n = malloc(sizeof(*n));
+	int len = playqueue_len(q);
+
+	if (pos < 0)
+		pos = 0;
+	if (pos > len)
+		pos = len;
+	n->left = n->right = NULL;
+	n->item = item;
+	n->prio = next_prio(q);
+	n->size = 1;
+	insert_node(q, pos, n);
+	if (pos < q->cur || (pos == q->cur && q->cur < len))
+		q->cur++;
+	return n;
+}
+
+/*
+ * Takes out the item at pos and returns it, or NULL if pos is out of range.
+ * Removing the current item makes the one after it current.
+ */
+void* playqueue_remove(playqueue_t *q, int pos)
+{
+	struct playqueue_node *n;
+	void *item;
+
+	if (pos < 0 || pos >= playqueue_len(q))
+		return NULL;
+	n = remove_node(q, pos);
+	item = n->item;
+	free(n);
+	if (pos < q->cur)
+		q->cur--;
+	return item;
+}
+
+/*
+ * Moves the item at from so that it ends up at to (clamped to the queue).
+ * The current item stays current, wherever it goes.
+ */
+void playqueue_move(playqueue_t *q, int from, int to)
+{
+	struct playqueue_node *n;
+	int len = playqueue_len(q);
+
+	if (from < 0 || from >= len)
+		return;
+	if (to < 0)
+		to = 0;
+	if (to > len - 1)
+		to = len - 1;
+	n = remove_node(q, from);
+	insert_node(q, to, n);
+
+	if (from == q->cur)
+		q->cur = to;
+	else if (from < q->cur && to >= q->cur)
+		q->cur--;
+	else if (from > q->cur && to <= q->cur)
+		q->cur++;
+}
+
+/*
+ * The position of a node playqueue_insert() returned.
+ */
+int playqueue_node_pos(struct playqueue_node *n)
+{
+	int pos = node_size(n->left);
+
+	for (; n->parent; n = n->parent)
+		if (n == n->parent->right)
+			pos += node_size(n->parent->left) + 1;
+	return pos;
+}
+
+/*
+ * The first position before end whose item match accepts, or -1, walking
+ * the items in order: O(log n) plus one call per item looked at.
+ */
+int playqueue_find(playqueue_t *q, int end, int (*match)(void *arg, void *item), void *arg)
+{
+	return find_nodes(q->root, 0, end, match, arg);
+}
@@ -0,0 +1,36 @@
+/*
+ * Play queue: a sequence of items with a current position, splitting it into
+ * history (before), the current item, and what is upcoming (after). Every
+ * operation by position is O(log n).
+ */
+#ifndef _SPOTIFY_CMD_PLAYQUEUE_H_
+#define _SPOTIFY_CMD_PLAYQUEUE_H_
+
+#include <stdint.h>
+
+
+/* --- Types --- */
+struct playqueue_node;
+
+typedef struct playqueue {
+	struct playqueue_node *root;
+	int cur;       /* position of the current item; the length when past the end */
+	uint32_t seed; /* for node priorities */
+} playqueue_t;
+
+
+/* --- Functions --- */
+void playqueue_init(playqueue_t *q);
+void playqueue_clear(playqueue_t *q, void (*release)(void *item));
+int playqueue_len(playqueue_t *q);
+void* playqueue_at(playqueue_t *q, int pos);
+int playqueue_pos(playqueue_t *q);
+void* playqueue_current(playqueue_t *q);
+void playqueue_jump(playqueue_t *q, int pos);
+struct playqueue_node* playqueue_insert(playqueue_t *q, int pos, void *item);
+void* playqueue_remove(playqueue_t *q, int pos);
+void playqueue_move(playqueue_t *q, int from, int to);
+int playqueue_node_pos(struct playqueue_node *n);
+int playqueue_find(playqueue_t *q, int end, int (*match)(void *arg, void *item), void *arg);
+
+#endif /* _SPOTIFY_CMD_PLAYQUEUE_H_ */
@@ -0,0 +1,427 @@
+/*
+ * Words are lowercased, with the accents of Latin-1 letters dropped; any
+ * other non-ASCII byte is kept as part of a word. Tokens get sorted lazily,
+ * when asked to or on the first query after new ones came in, by merging the
+ * new ones into the sorted array.
+ *
+ * A query walks the postings of whichever of its words matches the fewest
+ * tracks, and checks the other words against the tokens of each of those
+ * tracks by their rank in string order, so it costs about the size of its
+ * smallest posting lists, not the size of the tracklist.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+#define SEARCH_REMOVED UINT32_MAX /* in seen */
+
+
+/* what U+00C0 to U+00FF fold to, ' ' for the two that are not letters */
+static const char latin1_fold[] =
+	"aaaaaaaceeeeiiiidnooooo ouuuuytsaaaaaaaceeeeiiiidnooooo ouuuuyty";
+
+struct token_sort {
+	const char *s;
+	uint32_t id;
+};
+
+
+static uint32_t hash(const char *s)
+{
+	uint32_t h = 2166136261u; /* FNV-1a */
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static uint32_t next_cap(uint32_t cap, uint32_t want)
+{
+	uint32_t n = cap ? cap : 64;
+
+	while (n < want)
+		n *= 2;
+	return n;
+}
+
+/*
+ * Copies the next normalized word of *s into tok and returns its length, or
+ * 0 when there are no words left.
+ */
+static int next_token(const char **s, char *tok)
+{
+	const unsigned char *p = (const unsigned char *)*s;
+	int len = 0;
+	char c;
+
+	for (; *p; p++) {
+		if ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9'))
+			c = *p;
+		else if (*p >= 'A' && *p <= 'Z')
+			c = *p - 'A' + 'a';
+		else if (*p == 0xc3 && p[1] >= 0x80 && p[1] <= 0xbf)
+			c = latin1_fold[*++p - 0x80];
+		else if (*p >= 0x80)
+			c = *p;
+		else
+			c = ' ';
+
+		if (c != ' ') {
+			if (len < SEARCH_TOKEN_MAX - 1)
+				tok[len++] = c;
+		}
+		else if (len) {
+			break;
+		}
+	}
+	tok[len] = '\0';
+	*s = (const char *)p;
+	return len;
+}
+
+static uint32_t add_string(search_index_t *si, const char *s)
+{
+	uint32_t len = strlen(s) + 1, off = si->strings_len;
+
+	if (si->strings_len + len > si->strings_cap) {
+		si->strings_cap = next_cap(si->strings_cap, si->strings_len + len);
+		si->strings = realloc(si->strings, si->strings_cap);
+	}
+	memcpy(si->strings + off, s, len);
+	si->strings_len += len;
+	return off;
+}
+
+static void rehash(search_index_t *si)
+{
+	uint32_t i, j, mask;
+
+	free(si->token_slots);
+	si->token_slots_len = si->token_slots_len ? si->token_slots_len * 2 : 1024;
+	si->token_slots = calloc(si->token_slots_len, sizeof(uint32_t));
+	mask = si->token_slots_len - 1;
+	for (i = 0; i < si->ntokens; i++) {
+		for (j = hash(si->strings + si->token_str[i]) & mask; si->token_slots[j];
+		     j = (j + 1) & mask)
+			;
+		si->token_slots[j] = i + 1;
+	}
+}
+
+static uint32_t intern(search_index_t *si, const char *tok)
+{
+	uint32_t j, id, mask;
+
+	if (2 * (si->ntokens + 1) > si->token_slots_len)
+		rehash(si);
+	mask = si->token_slots_len - 1;
+	for (j = hash(tok) & mask; si->token_slots[j]; j = (j + 1) & mask) {
+		id = si->token_slots[j] - 1;
+		if (!strcmp(si->strings + si->token_str[id], tok))
+			return id;
+	}
+
+	id = si->ntokens++;
+	if (id >= si->tokens_cap) {
+		si->tokens_cap = next_cap(si->tokens_cap, id + 1);
+		si->token_str = realloc(si->token_str, si->tokens_cap * sizeof(uint32_t));
+		si->postings = realloc(si->postings, si->tokens_cap * sizeof(*si->postings));
+		si->sorted = realloc(si->sorted, si->tokens_cap * sizeof(uint32_t));
+		si->rank = realloc(si->rank, si->tokens_cap * sizeof(uint32_t));
+	}
+	si->token_str[id] = add_string(si, tok);
+	memset(&si->postings[id], 0, sizeof(si->postings[id]));
+	si->token_slots[j] = id + 1;
+	return id;
+}
+
+static void postings_add(struct search_postings *p, uint32_t id)
+{
+	if (p->n == p->cap) {
+		p->cap = p->cap ? p->cap * 2 : 4;
+		p->ids = realloc(p->ids, p->cap * sizeof(uint32_t));
+	}
+	p->ids[p->n++] = id;
+}
+
+static int token_sort_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct token_sort *)a)->s, ((const struct token_sort *)b)->s);
+}
+
+/* the ranks of the tokens term is a prefix of, in [*lo, *hi) */
+static void prefix_range(search_index_t *si, const char *term, size_t len,
+			 uint32_t *lo, uint32_t *hi)
+{
+	uint32_t a = 0, b = si->nsorted, m;
+
+	while (a < b) {
+		m = a + (b - a) / 2;
+		if (strcmp(si->strings + si->token_str[si->sorted[m]], term) < 0)
+			a = m + 1;
+		else
+			b = m;
+	}
+	*lo = a;
+	b = si->nsorted;
+	while (a < b) {
+		m = a + (b - a) / 2;
+		if (!strncmp(si->strings + si->token_str[si->sorted[m]], term, len))
+			a = m + 1;
+		else
+			b = m;
+	}
+	*hi = a;
+}
+
+
+void search_index_init(search_index_t *si)
+{
+	memset(si, 0, sizeof(*si));
+}
+
+void search_index_clear(search_index_t *si)
+{
+	uint32_t i;
+
+	for (i = 0; i < si->ntokens; i++)
+		free(si->postings[i].ids);
+	free(si->token_str);
+	free(si->postings);
+	free(si->token_slots);
+	free(si->sorted);
+	free(si->rank);
+	free(si->track_tokens);
+	free(si->track_start);
+	free(si->seen);
+	free(si->strings);
+	search_index_init(si);
+}
+
+/*
+ * Indexes the words of track id, the caller's (e.g. the track store's), which
+ * has to come after every id indexed so far; ids skipped over never match.
+ * Returns -1, indexing nothing, if id does not come after them.
+ */
+int search_index_add(search_index_t *si, int id, const char *name, const char *album,
+		     const char *artist)
+{
+	const char *fields[] = { name, album, artist };
+	char tok[SEARCH_TOKEN_MAX];
+	uint32_t t, i, f;
+
+	if (id < 0 || (uint32_t)id < si->ntracks)
+		return -1;
+	if ((uint32_t)id >= si->tracks_cap) {
+		si->tracks_cap = next_cap(si->tracks_cap, id + 1);
+		si->track_start = realloc(si->track_start, (si->tracks_cap + 1) * sizeof(uint32_t));
+		si->seen = realloc(si->seen, si->tracks_cap * sizeof(uint32_t));
+	}
+	for (; si->ntracks < (uint32_t)id; si->ntracks++) {
+		si->track_start[si->ntracks] = si->ntrack_tokens;
+		si->seen[si->ntracks] = SEARCH_REMOVED;
+	}
+	si->ntracks++;
+	si->track_start[id] = si->ntrack_tokens;
+	si->seen[id] = 0;
+
+	for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+		const char *s = fields[f];
+
+		while (next_token(&s, tok)) {
+			t = intern(si, tok);
+			for (i = si->track_start[id]; i < si->ntrack_tokens; i++)
+				if (si->track_tokens[i] == t)
+					break;
+			if (i < si->ntrack_tokens)
+				continue;
+			if (si->ntrack_tokens == si->track_tokens_cap) {
+				si->track_tokens_cap = next_cap(si->track_tokens_cap, si->ntrack_tokens + 1);
+				si->track_tokens = realloc(si->track_tokens,
+							   si->track_tokens_cap * sizeof(uint32_t));
+			}
+			si->track_tokens[si->ntrack_tokens++] = t;
+			postings_add(&si->postings[t], id);
+		}
+	}
+	si->track_start[id + 1] = si->ntrack_tokens;
+	return 0;
+}
+
+/*
+ * Leaves the track out of later results. Its words stay indexed until the
+ * index is cleared.
+ */
+void search_index_remove(search_index_t *si, int id)
+{
+	if (id >= 0 && (uint32_t)id < si->ntracks)
+		si->seen[id] = SEARCH_REMOVED;
+}
+
+/*
+ * Merges the tokens added since into the sorted ones, so that the next query
+ * does not have to. Queries call it anyway.
+ */
+void search_index_sort(search_index_t *si)
+{
+	uint32_t nnew = si->ntokens - si->nsorted, i, j, k;
+	struct token_sort *fresh;
+	uint32_t *merged;
+
+	if (!nnew)
+		return;
+	fresh = malloc(nnew * sizeof(*fresh));
+	for (i = 0; i < nnew; i++) {
+		fresh[i].id = si->nsorted + i;
+		fresh[i].s = si->strings + si->token_str[fresh[i].id];
+	}
+	qsort(fresh, nnew, sizeof(*fresh), token_sort_cmp);
+
+	merged = malloc(si->tokens_cap * sizeof(uint32_t));
+	for (i = j = k = 0; i < si->nsorted || j < nnew; k++) {
+		if (j == nnew ||
+		    (i < si->nsorted && strcmp(si->strings + si->token_str[si->sorted[i]], fresh[j].s) < 0))
+			merged[k] = si->sorted[i++];
+		else
+			merged[k] = fresh[j++].id;
+		si->rank[merged[k]] = k;
+	}
+	free(si->sorted);
+	free(fresh);
+	si->sorted = merged;
+	si->nsorted = si->ntokens;
+}
+
+/*
+ * Looks up the words of query, once for the tracks it is then matched
+ * against. Returns at most how many tracks can match, 0 when none can.
+ */
+uint32_t search_query_init(search_index_t *si, search_query_t *sq, const char *query)
+{
+	char term[SEARCH_TOKEN_MAX];
+	uint32_t size, r;
+	int len;
+
+	search_index_sort(si);
+	sq->nterms = 0;
+	sq->best = 0;
+	sq->best_size = UINT32_MAX;
+	while (sq->nterms < SEARCH_TERMS_MAX && (len = next_token(&query, term))) {
+		prefix_range(si, term, len, &sq->lo[sq->nterms], &sq->hi[sq->nterms]);
+		size = 0;
+		for (r = sq->lo[sq->nterms]; r < sq->hi[sq->nterms]; r++)
+			size += si->postings[si->sorted[r]].n;
+		if (size < sq->best_size) {
+			sq->best = sq->nterms;
+			sq->best_size = size;
+		}
+		sq->nterms++;
+	}
+	if (!sq->nterms)
+		sq->best_size = 0;
+	return sq->best_size;
+}
+
+/* whether track id has the words of sq, other than skip */
+static int track_has_terms(search_index_t *si, search_query_t *sq, uint32_t id, int skip)
+{
+	uint32_t i, k;
+	int t;
+
+	for (t = 0; t < sq->nterms; t++) {
+		if (t == skip)
+			continue;
+		for (i = si->track_start[id]; i < si->track_start[id + 1]; i++) {
+			k = si->rank[si->track_tokens[i]];
+			if (k >= sq->lo[t] && k < sq->hi[t])
+				break;
+		}
+		if (i == si->track_start[id + 1])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Whether track id, which must not have been removed, matches sq. Costs
+ * about the number of words of the track times those of the query.
+ */
+int search_query_match(search_index_t *si, search_query_t *sq, int id)
+{
+	return sq->nterms && track_has_terms(si, sq, id, -1);
+}
+
+/*
+ * Calls match for every track that has, for every word of sq, a word
+ * starting with it, in no particular order, until match returns non-zero.
+ * Returns the number of tracks match was called for.
+ */
+int search_query_each(search_index_t *si, search_query_t *sq,
+		      int (*match)(void *arg, int id), void *arg)
+{
+	uint32_t r, p, i, id;
+	int found = 0, stop = 0;
+
+	if (!sq->best_size)
+		return 0;
+
+	if (++si->stamp == SEARCH_REMOVED) {
+		for (i = 0; i < si->ntracks; i++)
+			if (si->seen[i] != SEARCH_REMOVED)
+				si->seen[i] = 0;
+		si->stamp = 1;
+	}
+
+	for (r = sq->lo[sq->best]; r < sq->hi[sq->best] && !stop; r++) {
+		struct search_postings *postings = &si->postings[si->sorted[r]];
+
+		for (p = 0; p < postings->n && !stop; p++) {
+			id = postings->ids[p];
+			if (si->seen[id] == si->stamp || si->seen[id] == SEARCH_REMOVED)
+				continue;
+			si->seen[id] = si->stamp;
+			if (track_has_terms(si, sq, id, sq->best)) {
+				found++;
+				stop = match(arg, id);
+			}
+		}
+	}
+	return found;
+}
+
+struct find_results {
+	int *ids;
+	int n;
+	int max;
+};
+
+static int find_match(void *arg, int id)
+{
+	struct find_results *res = arg;
+	int j;
+
+	/* insertion sort, max is small */
+	for (j = res->n++; j > 0 && res->ids[j - 1] > id; j--)
+		res->ids[j] = res->ids[j - 1];
+	res->ids[j] = id;
+	return res->n == res->max;
+}
+
+/*
+ * Finds tracks that have, for every word of query, a word starting with it.
+ * Stops at max of them: their ids go to ids, in ascending order, and the
+ * number found is returned. They are the first matches by id when the word
+ * of query matching the fewest tracks only starts one indexed word.
+ */
+int search_index_find(search_index_t *si, const char *query, int *ids, int max)
+{
+	struct find_results res = { ids, 0, max };
+	search_query_t sq;
+
+	if (max <= 0 || !search_query_init(si, &sq, query))
+		return 0;
+	search_query_each(si, &sq, find_match, &res);
+	return res.n;
+}
@@ -0,0 +1,76 @@
+/*
+ * Search over the names, albums and artists of the tracks in the tracklist:
+ * an inverted index from normalized words to the tracks that contain them,
+ * where every word of a query matches any word it is a prefix of.
+ */
+#ifndef _SPOTIFY_CMD_SEARCH_H_
+#define _SPOTIFY_CMD_SEARCH_H_
+
+#include <stdint.h>
+
+
+/* --- Definitions --- */
+#define SEARCH_TOKEN_MAX 32 /* bytes; longer words are cut */
+#define SEARCH_TERMS_MAX 8  /* words of a query past this are ignored */
+
+
+/* --- Types --- */
+struct search_postings {
+	uint32_t *ids; /* ascending */
+	uint32_t n;
+	uint32_t cap;
+};
+
+typedef struct search_index {
+	/* per token, interned */
+	uint32_t *token_str; /* offsets in strings */
+	struct search_postings *postings;
+	uint32_t ntokens;
+	uint32_t tokens_cap;
+	uint32_t *token_slots; /* open addressing, id + 1 per slot, 0 when free */
+	uint32_t token_slots_len;
+
+	/* token ids in string order, for prefixes; tokens past nsorted are new */
+	uint32_t *sorted;
+	uint32_t *rank; /* of each token in sorted */
+	uint32_t nsorted;
+
+	/* per track: its tokens, track_tokens[track_start[id]..track_start[id + 1]] */
+	uint32_t *track_tokens;
+	uint32_t ntrack_tokens;
+	uint32_t track_tokens_cap;
+	uint32_t *track_start;
+	uint32_t *seen; /* stamp of the last query that met the track */
+	uint32_t ntracks;
+	uint32_t tracks_cap;
+	uint32_t stamp;
+
+	char *strings;
+	uint32_t strings_len;
+	uint32_t strings_cap;
+} search_index_t;
+
+/* a query with its words looked up */
+typedef struct search_query {
+	uint32_t lo[SEARCH_TERMS_MAX]; /* ranks of the words each one starts */
+	uint32_t hi[SEARCH_TERMS_MAX];
+	int nterms;
+	int best;           /* the word matching the fewest tracks */
+	uint32_t best_size; /* postings of those */
+} search_query_t;
+
+
+/* --- Functions --- */
+void search_index_init(search_index_t *si);
+void search_index_clear(search_index_t *si);
+int search_index_add(search_index_t *si, int id, const char *name, const char *album,
+		     const char *artist);
+void search_index_remove(search_index_t *si, int id);
+void search_index_sort(search_index_t *si);
+int search_index_find(search_index_t *si, const char *query, int *ids, int max);
+uint32_t search_query_init(search_index_t *si, search_query_t *sq, const char *query);
+int search_query_match(search_index_t *si, search_query_t *sq, int id);
+int search_query_each(search_index_t *si, search_query_t *sq,
+		      int (*match)(void *arg, int id), void *arg);
+
+#endif /* _SPOTIFY_CMD_SEARCH_H_ */
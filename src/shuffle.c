@@ -0,0 +1,380 @@
+/*
+ * Stepping through the permutation is O(1). Editing the tracklist under it
+ * renumbers positions, which is O(n) over the permutation; that happens on
+ * edits only, not on every track.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "shuffle.h"
+
+#define SHUFFLE_MAGIC "SPSH"
+#define SHUFFLE_VERSION 1
+
+struct shuffle_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t len;
+	uint32_t idx;
+	uint64_t key; /* what the permutation is of, as told by the caller */
+	uint64_t rng;
+};
+
+
+static uint64_t next_rand(shuffle_t *s)
+{
+	s->rng ^= s->rng >> 12;
+	s->rng ^= s->rng << 25;
+	s->rng ^= s->rng >> 27;
+	return s->rng * 2685821657736338717ull;
+}
+
+/* uniform in [0, n) */
+static uint32_t rand_below(shuffle_t *s, uint32_t n)
+{
+	return (uint32_t)(((next_rand(s) >> 32) * n) >> 32);
+}
+
+static void reserve(shuffle_t *s, uint32_t len)
+{
+	if (len <= s->cap)
+		return;
+	s->cap = s->cap ? s->cap : 64;
+	while (s->cap < len)
+		s->cap *= 2;
+	s->perm = realloc(s->perm, s->cap * sizeof(*s->perm));
+}
+
+/* Fisher-Yates over perm[from..len) */
+static void shuffle_range(shuffle_t *s, uint32_t from)
+{
+	uint32_t i, j, t;
+
+	s->dirty = 1;
+	for (i = s->len; i > from + 1; i--) {
+		j = from + rand_below(s, i - from);
+		t = s->perm[i - 1];
+		s->perm[i - 1] = s->perm[j];
+		s->perm[j] = t;
+	}
+}
+
+static uint32_t find(shuffle_t *s, uint32_t pos)
+{
+	uint32_t i;
+
+	for (i = 0; i < s->len && s->perm[i] != pos; i++)
+		;
+	return i;
+}
+
+
+void shuffle_init(shuffle_t *s, uint64_t seed)
+{
+	memset(s, 0, sizeof(*s));
+	s->rng = seed ? seed : 88172645463325252ull;
+}
+
+void shuffle_free(shuffle_t *s)
+{
+	free(s->perm);
+	s->perm = NULL;
+	s->len = s->cap = s->idx = 0;
+}
+
+/*
+ * A new permutation of len positions, starting with first (when it is one of
+ * them) so that whatever is playing stays the current track.
+ */
+void shuffle_reset(shuffle_t *s, uint32_t len, uint32_t first)
+{
+	uint32_t i;
+
+	reserve(s, len);
+	s->len = len;
+	s->idx = 0;
+	for (i = 0; i < len; i++)
+		s->perm[i] = i;
+	if (first < len) {
+		s->perm[first] = 0;
+		s->perm[0] = first;
+		shuffle_range(s, 1);
+	}
+	else {
+		shuffle_range(s, 0);
+	}
+}
+
+uint32_t shuffle_current(shuffle_t *s)
+{
+	return s->idx < s->len ? s->perm[s->idx] : s->len;
+}
+
+/*
+ * Steps to the next position. Past the last one the whole order is shuffled
+ * again, never starting with the track that was just played.
+ */
+uint32_t shuffle_next(shuffle_t *s)
+{
+	uint32_t last, j;
+
+	if (s->len == 0)
+		return 0;
+	if (++s->idx < s->len)
+		return s->perm[s->idx];
+
+	last = s->perm[s->len - 1];
+	shuffle_range(s, 0);
+	if (s->len > 1 && s->perm[0] == last) {
+		j = 1 + rand_below(s, s->len - 1);
+		s->perm[0] = s->perm[j];
+		s->perm[j] = last;
+	}
+	s->idx = 0;
+	return s->perm[0];
+}
+
+/*
+ * Steps back, staying on the first track of the current cycle.
+ */
+uint32_t shuffle_prev(shuffle_t *s)
+{
+	if (s->idx > 0)
+		s->idx--;
+	return shuffle_current(s);
+}
+
+/*
+ * The position before the current one, or -1 if the cycle starts there.
+ */
+int shuffle_peek_prev(shuffle_t *s)
+{
+	return s->idx > 0 && s->idx <= s->len ? (int)s->perm[s->idx - 1] : -1;
+}
+
+/*
+ * The position after the current one, or -1 if the cycle ends there.
+ */
+int shuffle_peek(shuffle_t *s)
+{
+	return s->idx + 1 < s->len ? (int)s->perm[s->idx + 1] : -1;
+}
+
+/*
+ * Makes pos the next track of the cycle and steps to it, so that nothing
+ * else gets skipped or played twice.
+ */
+void shuffle_jump(shuffle_t *s, uint32_t pos)
+{
+	uint32_t i = find(s, pos), j;
+
+	if (i == s->len)
+		return;
+	s->dirty = 1;
+	if (i <= s->idx) {
+		/* already played in this cycle: play it again now */
+		memmove(s->perm + i, s->perm + i + 1, (s->idx - i) * sizeof(*s->perm));
+		s->perm[s->idx] = pos;
+		return;
+	}
+	j = s->idx + 1;
+	s->perm[i] = s->perm[j];
+	s->perm[j] = pos;
+	s->idx = j;
+}
+
+/*
+ * A position was inserted into the tracklist at pos. It is played after
+ * more tracks following the current one, or at a random place among the
+ * upcoming ones when after is negative.
+ */
+void shuffle_insert(shuffle_t *s, uint32_t pos, int after)
+{
+	uint32_t i, from, j;
+
+	s->dirty = 1;
+	for (i = 0; i < s->len; i++)
+		if (s->perm[i] >= pos)
+			s->perm[i]++;
+	reserve(s, s->len + 1);
+	s->perm[s->len++] = pos;
+
+	from = s->idx + 1 < s->len ? s->idx + 1 : s->len - 1;
+	if (after < 0)
+		j = from + rand_below(s, s->len - from);
+	else
+		j = from + after < s->len ? from + after : s->len - 1;
+	s->perm[s->len - 1] = s->perm[j];
+	s->perm[j] = pos;
+}
+
+/*
+ * The tracklist position pos is gone. If it was the current one, the next in
+ * the order becomes current, wrapping around like shuffle_next().
+ */
+void shuffle_remove(shuffle_t *s, uint32_t pos)
+{
+	uint32_t i = find(s, pos), k;
+
+	if (i == s->len)
+		return;
+	s->dirty = 1;
+	memmove(s->perm + i, s->perm + i + 1, (s->len - i - 1) * sizeof(*s->perm));
+	s->len--;
+	if (i < s->idx)
+		s->idx--;
+	for (k = 0; k < s->len; k++)
+		if (s->perm[k] > pos)
+			s->perm[k]--;
+	if (s->idx == s->len && s->len > 0) {
+		/* the last of the cycle went: start the next one */
+		s->idx--;
+		shuffle_next(s);
+	}
+}
+
+/*
+ * The track at position from of the tracklist now is at to; the play order
+ * does not change.
+ */
+void shuffle_move(shuffle_t *s, uint32_t from, uint32_t to)
+{
+	uint32_t i;
+
+	s->dirty = 1;
+	for (i = 0; i < s->len; i++) {
+		if (s->perm[i] == from)
+			s->perm[i] = to;
+		else if (from < to && s->perm[i] > from && s->perm[i] <= to)
+			s->perm[i]--;
+		else if (to < from && s->perm[i] >= to && s->perm[i] < from)
+			s->perm[i]++;
+	}
+}
+
+/* makes a rename into the directory of path last */
+static int sync_dir(const char *path)
+{
+	char dir[1024];
+	const char *slash = strrchr(path, '/');
+	int fd, ret;
+
+	if (!slash)
+		snprintf(dir, sizeof(dir), ".");
+	else if (slash == path)
+		snprintf(dir, sizeof(dir), "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+	fd = open(dir, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * When only the position and the random state moved, just the header is
+ * written over, in a single write. A new permutation is synced to disk aside,
+ * then renamed and its directory synced, so that a reboot finds the old order
+ * or the new one.
+ */
+int shuffle_save(shuffle_t *s, const char *path, uint64_t key)
+{
+	struct shuffle_header h;
+	char tmp[1024];
+	FILE *f;
+	int fd, ret = 0;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SHUFFLE_MAGIC, 4);
+	h.version = SHUFFLE_VERSION;
+	h.len = s->len;
+	h.idx = s->idx;
+	h.key = key;
+	h.rng = s->rng;
+
+	if (!s->dirty && s->saved_key == key && (fd = open(path, O_WRONLY)) >= 0) {
+		ret = pwrite(fd, &h, sizeof(h), 0) == sizeof(h) ? 0 : -1;
+		if (close(fd) || ret) {
+			log_warn("shuffle: cannot write %s: %s", path, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f) {
+		log_warn("shuffle: cannot write %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(s->perm, sizeof(*s->perm), s->len, f) != s->len)
+		ret = -1;
+	if (!ret && (fflush(f) || fsync(fileno(f))))
+		ret = -1;
+	if (fclose(f) || ret || rename(tmp, path)) {
+		log_warn("shuffle: cannot write %s: %s", path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if (sync_dir(path))
+		log_warn("shuffle: cannot sync the directory of %s: %s", path, strerror(errno));
+	s->dirty = 0;
+	s->saved_key = key;
+	return 0;
+}
+
+/*
+ * Picks a saved order up again, if it was saved under the same key for len
+ * positions. Returns 0 then, -1 otherwise, leaving s as it was.
+ */
+int shuffle_load(shuffle_t *s, const char *path, uint64_t key, uint32_t len)
+{
+	struct shuffle_header h;
+	uint32_t *perm;
+	uint8_t *seen;
+	uint32_t i;
+	FILE *f;
+	int ok;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ok = fread(&h, sizeof(h), 1, f) == 1 && !memcmp(h.magic, SHUFFLE_MAGIC, 4) &&
+		h.version == SHUFFLE_VERSION && h.key == key && h.len == len &&
+		(h.idx < len || len == 0);
+	perm = malloc((len ? len : 1) * sizeof(*perm));
+	ok = ok && fread(perm, sizeof(*perm), len, f) == len;
+	fclose(f);
+
+	/* must be a permutation */
+	seen = calloc(len ? len : 1, 1);
+	for (i = 0; ok && i < len; i++) {
+		if (perm[i] >= len || seen[perm[i]])
+			ok = 0;
+		else
+			seen[perm[i]] = 1;
+	}
+	free(seen);
+	if (!ok) {
+		free(perm);
+		return -1;
+	}
+
+	free(s->perm);
+	s->perm = perm;
+	s->len = s->cap = len;
+	s->idx = h.idx;
+	s->rng = h.rng ? h.rng : s->rng;
+	s->dirty = 0;
+	s->saved_key = key;
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Shuffled play order over the positions of the tracklist: a permutation,
+ * walked one step at a time and reshuffled when it wraps. It can be saved and
+ * picked up again where it was.
+ */
+#ifndef _SPOTIFY_CMD_SHUFFLE_H_
+#define _SPOTIFY_CMD_SHUFFLE_H_
+
+#include <stdint.h>
+
+
+/* --- Types --- */
+typedef struct shuffle {
+	uint32_t *perm; /* tracklist positions, in play order */
+	uint32_t len;
+	uint32_t cap;
+	uint32_t idx;   /* index in perm of the current track */
+	uint64_t rng;   /* xorshift64* state */
+	int dirty;      /* perm changed since it was last saved or loaded */
+	uint64_t saved_key;
+} shuffle_t;
+
+
+/* --- Functions --- */
+void shuffle_init(shuffle_t *s, uint64_t seed);
+void shuffle_free(shuffle_t *s);
+void shuffle_reset(shuffle_t *s, uint32_t len, uint32_t first);
+uint32_t shuffle_current(shuffle_t *s);
+uint32_t shuffle_next(shuffle_t *s);
+uint32_t shuffle_prev(shuffle_t *s);
+int shuffle_peek(shuffle_t *s);
+int shuffle_peek_prev(shuffle_t *s);
+void shuffle_jump(shuffle_t *s, uint32_t pos);
+void shuffle_insert(shuffle_t *s, uint32_t pos, int after);
+void shuffle_remove(shuffle_t *s, uint32_t pos);
+void shuffle_move(shuffle_t *s, uint32_t from, uint32_t to);
+int shuffle_save(shuffle_t *s, const char *path, uint64_t key);
+int shuffle_load(shuffle_t *s, const char *path, uint64_t key, uint32_t len);
+
+#endif /* _SPOTIFY_CMD_SHUFFLE_H_ */
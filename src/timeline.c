@@ -0,0 +1,108 @@
+/*
+ * Only the first mark of each phase counts, so the hooks can sit on paths
+ * that run for every track or every chunk; after the first time they cost a
+ * load and a branch. The report goes out as soon as the first audio is
+ * written, from whichever thread wrote it.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "timeline.h"
+
+
+static const char *phase_names[TIMELINE_PHASES] = {
+	"start",
+	"session_created",
+	"login",
+	"logged_in",
+	"first_track",
+	"resolved",
+	"player_load",
+	"first_delivery",
+	"first_write",
+};
+
+int timeline_json;
+
+static uint64_t marks[TIMELINE_PHASES];
+static int reported;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void timeline_mark(enum timeline_phase phase)
+{
+	uint64_t none = 0;
+
+	if (__atomic_load_n(&marks[phase], __ATOMIC_RELAXED))
+		return;
+	if (!__atomic_compare_exchange_n(&marks[phase], &none, now_ns(), 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+	if (phase == TIMELINE_FIRST_WRITE)
+		timeline_report();
+}
+
+/* when the phase reached last before t was reached, phases not being in order */
+static uint64_t mark_before(uint64_t t, int phase)
+{
+	uint64_t prev = marks[TIMELINE_START], m;
+	int i;
+
+	for (i = 1; i < TIMELINE_PHASES; i++) {
+		m = __atomic_load_n(&marks[i], __ATOMIC_ACQUIRE);
+		if (i != phase && m && m <= t && m > prev)
+			prev = m;
+	}
+	return prev;
+}
+
+/*
+ * Milliseconds since start for every phase reached so far, and since the
+ * phase reached just before it. Only the first call reports anything.
+ */
+void timeline_report(void)
+{
+	uint64_t start = __atomic_load_n(&marks[TIMELINE_START], __ATOMIC_ACQUIRE);
+	uint64_t t;
+	char json[512];
+	int i, len = 0;
+
+	if (__atomic_exchange_n(&reported, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (i = 1; i < TIMELINE_PHASES; i++) {
+		t = __atomic_load_n(&marks[i], __ATOMIC_ACQUIRE);
+		if (timeline_json) {
+			len += snprintf(json + len, sizeof(json) - len, "%s\"%s\":", i > 1 ? "," : "",
+					phase_names[i]);
+			if (t)
+				len += snprintf(json + len, sizeof(json) - len, "%.3f", (t - start) / 1e6);
+			else
+				len += snprintf(json + len, sizeof(json) - len, "null");
+		}
+		else if (t) {
+			log_info("startup: %-16s %9.1f ms (+%.1f)", phase_names[i],
+				 (t - start) / 1e6, (t - mark_before(t, i)) / 1e6);
+		}
+		else {
+			log_info("startup: %-16s         - ms", phase_names[i]);
+		}
+	}
+	if (timeline_json) {
+		/* straight to the fd: stdio from this thread could race exit() */
+		char line[sizeof(json) + 32];
+		int n = snprintf(line, sizeof(line), "{\"startup_ms\":{%s}}\n", json);
+		if (write(STDOUT_FILENO, line, n) < 0)
+			log_warn("startup: could not write the timeline");
+	}
+}
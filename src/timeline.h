@@ -0,0 +1,30 @@
+/*
+ * Startup timeline: when each phase between launch and the first audio
+ * reaching the output device was first reached.
+ */
+#ifndef _SPOTIFY_CMD_TIMELINE_H_
+#define _SPOTIFY_CMD_TIMELINE_H_
+
+
+/* --- Definitions --- */
+enum timeline_phase {
+	TIMELINE_START,           /* main() */
+	TIMELINE_SESSION_CREATED, /* sp_session_create() returned */
+	TIMELINE_LOGIN,           /* sp_session_login() called */
+	TIMELINE_LOGGED_IN,       /* logged_in callback */
+	TIMELINE_FIRST_TRACK,     /* first track in the tracklist */
+	TIMELINE_RESOLVED,        /* every uri resolved */
+	TIMELINE_PLAYER_LOAD,     /* sp_session_player_load() succeeded */
+	TIMELINE_FIRST_DELIVERY,  /* music_delivery queued audio */
+	TIMELINE_FIRST_WRITE,     /* the output device got audio */
+	TIMELINE_PHASES
+};
+
+
+/* --- Functions --- */
+extern int timeline_json; /* report as one line of JSON on stdout */
+
+void timeline_mark(enum timeline_phase phase);
+void timeline_report(void);
+
+#endif /* _SPOTIFY_CMD_TIMELINE_H_ */
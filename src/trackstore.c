@@ -0,0 +1,212 @@
+/*
+ * Ids are handed out in order and never reused until the store is cleared.
+ * A track costs its uri and name plus 17 bytes; an album or an artist is
+ * stored once however many tracks point to it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trackstore.h"
+
+
+static uint32_t hash(const char *s, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed; /* FNV-1a */
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static uint32_t next_cap(uint32_t cap, uint32_t want)
+{
+	uint32_t n = cap ? cap : 64;
+
+	while (n < want)
+		n *= 2;
+	return n;
+}
+
+static uint32_t add_string(track_store_t *ts, const char *s)
+{
+	uint32_t len = strlen(s) + 1, off = ts->strings_len;
+
+	if (ts->strings_len + len > ts->strings_cap) {
+		ts->strings_cap = next_cap(ts->strings_cap, ts->strings_len + len);
+		ts->strings = realloc(ts->strings, ts->strings_cap);
+	}
+	memcpy(ts->strings + off, s, len);
+	ts->strings_len += len;
+	return off;
+}
+
+/* rebuilds a table of id + 1 per slot at twice the size */
+static uint32_t *rehash(uint32_t *slots, uint32_t *len, uint32_t n,
+			uint32_t (*slot_hash)(track_store_t *, uint32_t), track_store_t *ts)
+{
+	uint32_t i, j;
+
+	free(slots);
+	*len = *len ? *len * 2 : 256;
+	slots = calloc(*len, sizeof(*slots));
+	for (i = 0; i < n; i++) {
+		for (j = slot_hash(ts, i) & (*len - 1); slots[j]; j = (j + 1) & (*len - 1))
+			;
+		slots[j] = i + 1;
+	}
+	return slots;
+}
+
+static uint32_t artist_hash(track_store_t *ts, uint32_t id)
+{
+	return hash(ts->strings + ts->artist_name[id], 0);
+}
+
+static uint32_t album_hash(track_store_t *ts, uint32_t id)
+{
+	return hash(ts->strings + ts->album_name[id], ts->album_artist[id] + 1);
+}
+
+static uint32_t intern_artist(track_store_t *ts, const char *name)
+{
+	uint32_t j, id;
+
+	if (2 * (ts->nartists + 1) > ts->artist_slots_len)
+		ts->artist_slots = rehash(ts->artist_slots, &ts->artist_slots_len,
+					  ts->nartists, artist_hash, ts);
+	for (j = hash(name, 0) & (ts->artist_slots_len - 1); ts->artist_slots[j];
+	     j = (j + 1) & (ts->artist_slots_len - 1)) {
+		id = ts->artist_slots[j] - 1;
+		if (!strcmp(ts->strings + ts->artist_name[id], name))
+			return id;
+	}
+
+	id = ts->nartists++;
+	if (id >= ts->artists_cap) {
+		ts->artists_cap = next_cap(ts->artists_cap, id + 1);
+		ts->artist_name = realloc(ts->artist_name, ts->artists_cap * sizeof(uint32_t));
+	}
+	ts->artist_name[id] = add_string(ts, name);
+	ts->artist_slots[j] = id + 1;
+	return id;
+}
+
+static uint32_t intern_album(track_store_t *ts, const char *name, uint32_t artist)
+{
+	uint32_t j, id;
+
+	if (2 * (ts->nalbums + 1) > ts->album_slots_len)
+		ts->album_slots = rehash(ts->album_slots, &ts->album_slots_len,
+					 ts->nalbums, album_hash, ts);
+	for (j = hash(name, artist + 1) & (ts->album_slots_len - 1); ts->album_slots[j];
+	     j = (j + 1) & (ts->album_slots_len - 1)) {
+		id = ts->album_slots[j] - 1;
+		if (ts->album_artist[id] == artist && !strcmp(ts->strings + ts->album_name[id], name))
+			return id;
+	}
+
+	id = ts->nalbums++;
+	if (id >= ts->albums_cap) {
+		ts->albums_cap = next_cap(ts->albums_cap, id + 1);
+		ts->album_name = realloc(ts->album_name, ts->albums_cap * sizeof(uint32_t));
+		ts->album_artist = realloc(ts->album_artist, ts->albums_cap * sizeof(uint32_t));
+	}
+	ts->album_name[id] = add_string(ts, name);
+	ts->album_artist[id] = artist;
+	ts->album_slots[j] = id + 1;
+	return id;
+}
+
+
+void track_store_init(track_store_t *ts)
+{
+	memset(ts, 0, sizeof(*ts));
+}
+
+void track_store_clear(track_store_t *ts)
+{
+	free(ts->uri);
+	free(ts->name);
+	free(ts->album);
+	free(ts->duration_ms);
+	free(ts->flags);
+	free(ts->album_name);
+	free(ts->album_artist);
+	free(ts->artist_name);
+	free(ts->album_slots);
+	free(ts->artist_slots);
+	free(ts->strings);
+	track_store_init(ts);
+}
+
+/*
+ * Adds a track, available, and returns its id.
+ */
+int track_store_add(track_store_t *ts, const char *uri, const char *name,
+		    const char *album, const char *artist, int duration_ms)
+{
+	uint32_t id = ts->ntracks++;
+
+	if (id >= ts->tracks_cap) {
+		ts->tracks_cap = next_cap(ts->tracks_cap, id + 1);
+		ts->uri = realloc(ts->uri, ts->tracks_cap * sizeof(uint32_t));
+		ts->name = realloc(ts->name, ts->tracks_cap * sizeof(uint32_t));
+		ts->album = realloc(ts->album, ts->tracks_cap * sizeof(uint32_t));
+		ts->duration_ms = realloc(ts->duration_ms, ts->tracks_cap * sizeof(uint32_t));
+		ts->flags = realloc(ts->flags, ts->tracks_cap);
+	}
+	ts->uri[id] = add_string(ts, uri);
+	ts->name[id] = add_string(ts, name);
+	ts->album[id] = intern_album(ts, album, intern_artist(ts, artist));
+	ts->duration_ms[id] = duration_ms;
+	ts->flags[id] = TRACK_STORE_AVAILABLE;
+	return id;
+}
+
+const char* track_store_uri(track_store_t *ts, int id)
+{
+	return ts->strings + ts->uri[id];
+}
+
+const char* track_store_name(track_store_t *ts, int id)
+{
+	return ts->strings + ts->name[id];
+}
+
+const char* track_store_album(track_store_t *ts, int id)
+{
+	return ts->strings + ts->album_name[ts->album[id]];
+}
+
+const char* track_store_artist(track_store_t *ts, int id)
+{
+	return ts->strings + ts->artist_name[ts->album_artist[ts->album[id]]];
+}
+
+int track_store_duration(track_store_t *ts, int id)
+{
+	return ts->duration_ms[id];
+}
+
+int track_store_flags(track_store_t *ts, int id)
+{
+	return ts->flags[id];
+}
+
+void track_store_set_flags(track_store_t *ts, int id, int flags)
+{
+	ts->flags[id] = flags;
+}
+
+/*
+ * Heap memory held, counting reserved capacity.
+ */
+size_t track_store_bytes(track_store_t *ts)
+{
+	return (size_t)ts->tracks_cap * (4 * sizeof(uint32_t) + 1) +
+		(size_t)ts->albums_cap * 2 * sizeof(uint32_t) +
+		(size_t)ts->artists_cap * sizeof(uint32_t) +
+		(size_t)(ts->album_slots_len + ts->artist_slots_len) * sizeof(uint32_t) +
+		ts->strings_cap;
+}
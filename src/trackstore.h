@@ -0,0 +1,63 @@
+/*
+ * Metadata of the tracks in the tracklist, copied out of libspotify once when
+ * they are added: parallel arrays indexed by track id, with album and artist
+ * names interned, and every string in a single pool.
+ */
+#ifndef _SPOTIFY_CMD_TRACKSTORE_H_
+#define _SPOTIFY_CMD_TRACKSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* --- Definitions --- */
+#define TRACK_STORE_AVAILABLE 1 /* cleared when the track turns out not to play */
+
+
+/* --- Types --- */
+typedef struct track_store {
+	/* per track */
+	uint32_t *uri;     /* offsets in strings */
+	uint32_t *name;
+	uint32_t *album;   /* album id */
+	uint32_t *duration_ms;
+	uint8_t *flags;
+	uint32_t ntracks;
+	uint32_t tracks_cap;
+
+	/* per album, and per artist */
+	uint32_t *album_name;
+	uint32_t *album_artist; /* artist id */
+	uint32_t nalbums;
+	uint32_t albums_cap;
+	uint32_t *artist_name;
+	uint32_t nartists;
+	uint32_t artists_cap;
+
+	/* open addressing, id + 1 per slot, 0 when free */
+	uint32_t *album_slots;
+	uint32_t *artist_slots;
+	uint32_t album_slots_len;  /* a power of two */
+	uint32_t artist_slots_len;
+
+	char *strings;
+	uint32_t strings_len;
+	uint32_t strings_cap;
+} track_store_t;
+
+
+/* --- Functions --- */
+void track_store_init(track_store_t *ts);
+void track_store_clear(track_store_t *ts);
+int track_store_add(track_store_t *ts, const char *uri, const char *name,
+		    const char *album, const char *artist, int duration_ms);
+const char* track_store_uri(track_store_t *ts, int id);
+const char* track_store_name(track_store_t *ts, int id);
+const char* track_store_album(track_store_t *ts, int id);
+const char* track_store_artist(track_store_t *ts, int id);
+int track_store_duration(track_store_t *ts, int id);
+int track_store_flags(track_store_t *ts, int id);
+void track_store_set_flags(track_store_t *ts, int id, int flags);
+size_t track_store_bytes(track_store_t *ts);
+
+#endif /* _SPOTIFY_CMD_TRACKSTORE_H_ */
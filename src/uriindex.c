@@ -0,0 +1,405 @@
+/*
+ * Stores are kept in memory until the next commit. A commit that only
+ * refreshes the time of entries whose tracks did not change writes those
+ * times in place; otherwise the index is rewritten whole: entries for other
+ * uris are copied over, the new file is written next to the old one and
+ * renamed into place, then mapped again. Readers only ever see the mapping,
+ * which is checked once when it is made.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "uriindex.h"
+
+
+static const char *index_string(uri_index_t *idx, uint32_t off)
+{
+	return (const char *)idx->map + off;
+}
+
+static void index_unmap(uri_index_t *idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->size);
+	idx->map = NULL;
+	idx->size = 0;
+	idx->entries = NULL;
+	idx->nentries = 0;
+}
+
+/*
+ * Every offset must land inside the file and the file must end with a NUL,
+ * so that strings can be handed out straight from the mapping.
+ */
+static int index_valid(const void *map, size_t size)
+{
+	const struct uri_index_header *h = map;
+	const struct uri_index_entry *e;
+	const uint32_t *tracks;
+	uint32_t i, j;
+
+	if (size < sizeof(*h) || memcmp(h->magic, URI_INDEX_MAGIC, 4) ||
+	    h->version != URI_INDEX_VERSION || ((const char *)map)[size - 1])
+		return 0;
+	if (h->nentries > (size - sizeof(*h)) / sizeof(*e))
+		return 0;
+
+	e = (const struct uri_index_entry *)(h + 1);
+	for (i = 0; i < h->nentries; i++, e++) {
+		if (e->uri >= size || e->tracks % sizeof(uint32_t) ||
+		    e->tracks > size || e->ntracks > (size - e->tracks) / sizeof(uint32_t))
+			return 0;
+		tracks = (const uint32_t *)((const char *)map + e->tracks);
+		for (j = 0; j < e->ntracks; j++)
+			if (tracks[j] >= size)
+				return 0;
+	}
+	return 1;
+}
+
+static void index_map(uri_index_t *idx)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	index_unmap(idx);
+
+	fd = open(idx->path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			log_warn("index: %s: %s", idx->path, strerror(errno));
+		return;
+	}
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warn("index: %s: %s", idx->path, strerror(errno));
+		return;
+	}
+	if (!index_valid(map, st.st_size)) {
+		log_warn("index: %s is not a valid index, ignoring it", idx->path);
+		munmap(map, st.st_size);
+		return;
+	}
+
+	idx->map = map;
+	idx->size = st.st_size;
+	idx->entries = (const struct uri_index_entry *)((const struct uri_index_header *)map + 1);
+	idx->nentries = ((const struct uri_index_header *)map)->nentries;
+}
+
+void uri_index_open(uri_index_t *idx, const char *path)
+{
+	memset(idx, 0, sizeof(*idx));
+	idx->path = strdup(path);
+	index_map(idx);
+}
+
+void uri_index_close(uri_index_t *idx)
+{
+	uri_index_commit(idx);
+	free(idx->pending);
+	index_unmap(idx);
+	free(idx->path);
+	idx->path = NULL;
+}
+
+/*
+ * Returns the entry for uri, or NULL; what was stored since the last commit
+ * is not seen yet. The entry stays valid until the next uri_index_commit() or
+ * uri_index_close().
+ */
+const struct uri_index_entry* uri_index_lookup(uri_index_t *idx, const char *uri)
+{
+	uint32_t lo = 0, hi = idx->nentries, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = strcmp(uri, index_string(idx, idx->entries[mid].uri));
+		if (!c)
+			return &idx->entries[mid];
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+const char* uri_index_track(uri_index_t *idx, const struct uri_index_entry *e, uint32_t i)
+{
+	const uint32_t *tracks = (const uint32_t *)index_string(idx, e->tracks);
+
+	return index_string(idx, tracks[i]);
+}
+
+
+/* --- Writing --- */
+
+struct index_item {
+	const char *uri;
+	const char **tracks;
+	uint32_t ntracks;
+	int64_t resolved_at;
+	const struct uri_index_entry *same; /* pending only: the entry it matches */
+};
+
+static int item_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct index_item *)a)->uri, ((const struct index_item *)b)->uri);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int index_write(int fd, struct index_item *items, uint32_t nitems)
+{
+	struct uri_index_header h;
+	struct uri_index_entry *entries;
+	uint32_t *offsets;
+	uint32_t i, j, ntracks = 0, off;
+	size_t tracks_off, strings_off;
+	char *strings, *p;
+	int ret = -1;
+
+	for (i = 0; i < nitems; i++)
+		ntracks += items[i].ntracks;
+
+	tracks_off = sizeof(h) + nitems * sizeof(*entries);
+	strings_off = tracks_off + ntracks * sizeof(*offsets);
+
+	entries = calloc(nitems ? nitems : 1, sizeof(*entries));
+	offsets = calloc(ntracks ? ntracks : 1, sizeof(*offsets));
+
+	/* lay the strings out first to know their offsets */
+	off = strings_off;
+	for (i = 0; i < nitems; i++) {
+		entries[i].uri = off;
+		off += strlen(items[i].uri) + 1;
+	}
+	for (i = 0, ntracks = 0; i < nitems; i++) {
+		entries[i].tracks = tracks_off + ntracks * sizeof(*offsets);
+		entries[i].ntracks = items[i].ntracks;
+		entries[i].resolved_at = items[i].resolved_at;
+		for (j = 0; j < items[i].ntracks; j++) {
+			offsets[ntracks++] = off;
+			off += strlen(items[i].tracks[j]) + 1;
+		}
+	}
+
+	p = strings = malloc(off - strings_off + 1);
+	for (i = 0; i < nitems; i++)
+		p = stpcpy(p, items[i].uri) + 1;
+	for (i = 0; i < nitems; i++)
+		for (j = 0; j < items[i].ntracks; j++)
+			p = stpcpy(p, items[i].tracks[j]) + 1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, URI_INDEX_MAGIC, 4);
+	h.version = URI_INDEX_VERSION;
+	h.nentries = nitems;
+
+	if (!write_all(fd, &h, sizeof(h)) &&
+	    !write_all(fd, entries, nitems * sizeof(*entries)) &&
+	    !write_all(fd, offsets, ntracks * sizeof(*offsets)) &&
+	    !write_all(fd, strings, p - strings))
+		ret = 0;
+
+	free(strings);
+	free(offsets);
+	free(entries);
+	return ret;
+}
+
+static void item_free(struct index_item *item)
+{
+	uint32_t j;
+
+	for (j = 0; j < item->ntracks; j++)
+		free((char *)item->tracks[j]);
+	free(item->tracks);
+	free((char *)item->uri);
+}
+
+static void pending_clear(uri_index_t *idx)
+{
+	uint32_t i;
+
+	for (i = 0; i < idx->npending; i++)
+		item_free(&idx->pending[i]);
+	idx->npending = 0;
+}
+
+/*
+ * Records that uri resolved to tracks just now, replacing any previous entry
+ * once committed.
+ */
+void uri_index_store(uri_index_t *idx, const char *uri, const char **tracks, int ntracks)
+{
+	const struct uri_index_entry *e = uri_index_lookup(idx, uri);
+	struct index_item *item;
+	uint32_t i;
+	int j;
+
+	for (i = 0; i < idx->npending; i++)
+		if (!strcmp(idx->pending[i].uri, uri))
+			break;
+	if (i < idx->npending) {
+		item_free(&idx->pending[i]);
+	}
+	else {
+		if (idx->npending == idx->pending_cap) {
+			idx->pending_cap = idx->pending_cap ? 2 * idx->pending_cap : 8;
+			idx->pending = realloc(idx->pending, idx->pending_cap * sizeof(*idx->pending));
+		}
+		i = idx->npending++;
+	}
+	item = &idx->pending[i];
+
+	item->uri = strdup(uri);
+	item->tracks = malloc((ntracks ? ntracks : 1) * sizeof(char *));
+	for (j = 0; j < ntracks; j++)
+		item->tracks[j] = strdup(tracks[j]);
+	item->ntracks = ntracks;
+	item->resolved_at = time(NULL);
+
+	item->same = e && e->ntracks == (uint32_t)ntracks ? e : NULL;
+	for (j = 0; item->same && j < ntracks; j++)
+		if (strcmp(tracks[j], uri_index_track(idx, e, j)))
+			item->same = NULL;
+}
+
+/* pending entries all match the file: only their times need writing */
+static int index_touch(uri_index_t *idx)
+{
+	uint32_t i;
+	off_t off;
+	int fd, ret = 0;
+
+	fd = open(idx->path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < idx->npending && !ret; i++) {
+		off = (const char *)idx->pending[i].same - (const char *)idx->map
+			+ offsetof(struct uri_index_entry, resolved_at);
+		if (pwrite(fd, &idx->pending[i].resolved_at, sizeof(int64_t), off) != sizeof(int64_t))
+			ret = -1;
+	}
+	if (close(fd))
+		ret = -1;
+	return ret;
+}
+
+static int index_rewrite(uri_index_t *idx)
+{
+	struct index_item *items;
+	const struct uri_index_entry *e;
+	char tmp[1024];
+	uint32_t i, j, k, n = 0;
+	int fd, ret;
+
+	items = calloc(idx->nentries + idx->npending, sizeof(*items));
+	for (i = 0; i < idx->nentries; i++) {
+		e = &idx->entries[i];
+		for (k = 0; k < idx->npending; k++)
+			if (!strcmp(index_string(idx, e->uri), idx->pending[k].uri))
+				break;
+		if (k < idx->npending)
+			continue;
+		items[n].uri = index_string(idx, e->uri);
+		items[n].ntracks = e->ntracks;
+		items[n].resolved_at = e->resolved_at;
+		items[n].tracks = malloc((e->ntracks ? e->ntracks : 1) * sizeof(char *));
+		for (j = 0; j < e->ntracks; j++)
+			items[n].tracks[j] = uri_index_track(idx, e, j);
+		n++;
+	}
+	for (k = 0; k < idx->npending; k++) {
+		items[n] = idx->pending[k];
+		items[n].tracks = malloc((items[n].ntracks ? items[n].ntracks : 1) * sizeof(char *));
+		memcpy(items[n].tracks, idx->pending[k].tracks, items[n].ntracks * sizeof(char *));
+		n++;
+	}
+	qsort(items, n, sizeof(*items), item_cmp);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx->path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -1;
+	}
+	else {
+		ret = index_write(fd, items, n);
+		if (close(fd))
+			ret = -1;
+		if (!ret && rename(tmp, idx->path))
+			ret = -1;
+		if (ret)
+			unlink(tmp);
+	}
+
+	for (i = 0; i < n; i++)
+		free(items[i].tracks);
+	free(items);
+	return ret;
+}
+
+/*
+ * Writes out what was stored since the last commit, in one go. Returns 0 on
+ * success, -1 if the index could not be written (the previous one is then
+ * left in place, and what was stored is lost).
+ */
+int uri_index_commit(uri_index_t *idx)
+{
+	uint32_t i;
+	int ret;
+
+	if (!idx->npending)
+		return 0;
+	for (i = 0; i < idx->npending; i++)
+		if (!idx->pending[i].same)
+			break;
+
+	if (i == idx->npending) {
+		ret = index_touch(idx);
+	}
+	else {
+		ret = index_rewrite(idx);
+		/* the items pointed into the old mapping, drop it only now */
+		if (!ret)
+			index_map(idx);
+	}
+	if (ret)
+		log_warn("index: cannot write %s: %s", idx->path, strerror(errno));
+	pending_clear(idx);
+	return ret;
+}
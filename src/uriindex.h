@@ -0,0 +1,60 @@
+/*
+ * On-disk index from album and playlist uris to the track uris they resolved
+ * to, so that a tracklist can be rebuilt without browsing anything.
+ */
+#ifndef _SPOTIFY_CMD_URIINDEX_H_
+#define _SPOTIFY_CMD_URIINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/* --- Types --- */
+
+/*
+ * File layout, in host byte order: the header, the entries sorted by uri,
+ * the track lists (arrays of string offsets), then the strings. Offsets are
+ * from the start of the file.
+ */
+#define URI_INDEX_MAGIC "SPIX"
+#define URI_INDEX_VERSION 1
+
+struct uri_index_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t nentries;
+	uint32_t reserved;
+};
+
+struct uri_index_entry {
+	uint32_t uri;
+	uint32_t tracks;
+	uint32_t ntracks;
+	uint32_t reserved;
+	int64_t resolved_at; /* time(2) of the resolution */
+};
+
+typedef struct uri_index {
+	char *path;
+	void *map; /* the whole file, read only; NULL when empty */
+	size_t size;
+	const struct uri_index_entry *entries;
+	uint32_t nentries;
+
+	/* stored since the last commit, not in the file yet */
+	struct index_item *pending;
+	uint32_t npending;
+	uint32_t pending_cap;
+} uri_index_t;
+
+
+/* --- Functions --- */
+void uri_index_open(uri_index_t *idx, const char *path);
+void uri_index_close(uri_index_t *idx);
+const struct uri_index_entry* uri_index_lookup(uri_index_t *idx, const char *uri);
+const char* uri_index_track(uri_index_t *idx, const struct uri_index_entry *e, uint32_t i);
+void uri_index_store(uri_index_t *idx, const char *uri, const char **tracks, int ntracks);
+int uri_index_commit(uri_index_t *idx);
+
+#endif /* _SPOTIFY_CMD_URIINDEX_H_ */
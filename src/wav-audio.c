@@ -0,0 +1,149 @@
+/*
+ * WAV file audio output driver. Writes as fast as audio comes, to the file
+ * given as argument (wav:path), spotify_cmd.wav by default. Reopening, on a
+ * format change, starts the file over.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio.h"
+#include "log.h"
+
+#define WAV_HEADER_SIZE 44
+#define WAV_BUFFER_FRAMES 4096
+
+
+struct wav_out {
+	FILE *f;
+	int channels;
+	uint32_t data_bytes;
+	int16_t buf[WAV_BUFFER_FRAMES * 2];
+};
+
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void wav_header(unsigned char *h, int rate, int channels, uint32_t data_bytes)
+{
+	memcpy(h, "RIFF", 4);
+	put_le32(h + 4, 36 + data_bytes);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le32(h + 16, 16);
+	put_le16(h + 20, 1); /* PCM */
+	put_le16(h + 22, channels);
+	put_le32(h + 24, rate);
+	put_le32(h + 28, rate * channels * sizeof(int16_t));
+	put_le16(h + 32, channels * sizeof(int16_t));
+	put_le16(h + 34, 16);
+	memcpy(h + 36, "data", 4);
+	put_le32(h + 40, data_bytes);
+}
+
+static int wav_open(audio_sink_t *s, int rate, int channels)
+{
+	const char *path = s->arg ? s->arg : "spotify_cmd.wav";
+	unsigned char h[WAV_HEADER_SIZE];
+	struct wav_out *out;
+
+	if (channels > 2)
+		return -1;
+
+	out = calloc(1, sizeof(*out));
+	out->f = fopen(path, "wb");
+	if (!out->f) {
+		log_error("audio: Unable to open %s", path);
+		free(out);
+		return -1;
+	}
+	out->channels = channels;
+
+	/* sizes are patched in as audio is written */
+	wav_header(h, rate, channels, 0);
+	fwrite(h, 1, sizeof(h), out->f);
+	s->priv = out;
+	return 0;
+}
+
+/*
+ * Keeps the header in line with what has been written, so that the file is
+ * usable even if the program never gets to close it.
+ */
+static void wav_patch_sizes(struct wav_out *out)
+{
+	unsigned char h[4];
+
+	put_le32(h, 36 + out->data_bytes);
+	fseek(out->f, 4, SEEK_SET);
+	fwrite(h, 1, 4, out->f);
+	put_le32(h, out->data_bytes);
+	fseek(out->f, 40, SEEK_SET);
+	fwrite(h, 1, 4, out->f);
+	fseek(out->f, 0, SEEK_END);
+}
+
+static int wav_write(audio_sink_t *s, audio_batch_t *b)
+{
+	struct wav_out *out = s->priv;
+	int n;
+
+	while ((n = audio_batch_fill(b, out->buf, WAV_BUFFER_FRAMES)) > 0) {
+		fwrite(out->buf, sizeof(int16_t) * out->channels, n, out->f);
+		out->data_bytes += n * sizeof(int16_t) * out->channels;
+	}
+	wav_patch_sizes(out);
+	return 0;
+}
+
+static void wav_drain(audio_sink_t *s)
+{
+	struct wav_out *out = s->priv;
+	fflush(out->f);
+}
+
+static void wav_drop(audio_sink_t *s)
+{
+}
+
+static void wav_pause(audio_sink_t *s, int paused)
+{
+}
+
+static int wav_delay(audio_sink_t *s)
+{
+	return 0;
+}
+
+static void wav_close(audio_sink_t *s)
+{
+	struct wav_out *out = s->priv;
+
+	wav_patch_sizes(out);
+	fclose(out->f);
+	free(out);
+	s->priv = NULL;
+}
+
+const audio_sink_ops_t audio_sink_wav = {
+	.name = "wav",
+	.open = wav_open,
+	.write = wav_write,
+	.drain = wav_drain,
+	.drop = wav_drop,
+	.pause = wav_pause,
+	.delay = wav_delay,
+	.close = wav_close,
+};
@@ -0,0 +1,122 @@
+/*
+ * Benchmark of the audio FIFO on its own: a producer thread pushes audio
+ * through audio_put() as fast as the pool lets it, and the consumer pulls it
+ * with audio_get() and audio_batch_fill() the way the audio thread feeds a
+ * sink, for several chunk sizes. Prints the throughput, the queueing latency
+ * quantiles of audio_fifo_latency_us(), the deliveries turned down because
+ * the ring or the pool was full, and the CPU time of both threads.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../src/audio.h"
+
+#define BENCH_FRAMES (100 * 1000 * 1000) /* per chunk size, about 38 min of audio */
+#define BENCH_WRITE_FRAMES 4096 /* taken per audio_batch_fill(), like a sink period */
+
+
+static int chunk_frames[] = { 64, 256, 1024, AUDIO_CHUNK_SAMPLES / 2 };
+
+struct bench_run {
+	audio_fifo_t *af;
+	int frames; /* per chunk */
+};
+
+
+static void *producer(void *arg)
+{
+	struct bench_run *run = arg;
+	audio_fifo_t *af = run->af;
+	audio_fifo_data_t *afd;
+	int64_t sent = 0;
+	int n, j;
+
+	while (sent < BENCH_FRAMES) {
+		if (!(afd = audio_chunk_alloc(af))) {
+			af->put_rejects++;
+			sched_yield();
+			continue;
+		}
+		n = run->frames;
+		if (n > BENCH_FRAMES - sent)
+			n = BENCH_FRAMES - sent;
+		for (j = 0; j < n; j++)
+			afd->samples[2 * j] = afd->samples[2 * j + 1] = (int16_t)(sent + j);
+		afd->nsamples = n;
+		afd->rate = 44100;
+		afd->channels = 2;
+		afd->generation = 0;
+		while (!audio_put(af, afd)) {
+			af->put_rejects++;
+			sched_yield();
+		}
+		sent += n;
+	}
+	return NULL;
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+		+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void bench(int frames)
+{
+	static int16_t dst[BENCH_WRITE_FRAMES * 2];
+	struct bench_run run;
+	audio_fifo_t *af;
+	audio_batch_t b;
+	pthread_t tid;
+	int64_t got = 0;
+	double cpu;
+
+	if (posix_memalign((void **)&af, AUDIO_CACHELINE, sizeof(*af)))
+		exit(1);
+	memset(af, 0, sizeof(*af));
+	audio_fifo_init(af);
+	run.af = af;
+	run.frames = frames;
+	memset(&b, 0, sizeof(b));
+	b.af = af;
+
+	cpu = cpu_seconds();
+	pthread_create(&tid, NULL, producer, &run);
+	while (got < BENCH_FRAMES) {
+		if (!b.cur) {
+			b.cur = audio_get(af);
+			b.cur_off = 0;
+			b.rate = b.cur->rate;
+			b.channels = b.cur->channels;
+		}
+		got += audio_batch_fill(&b, dst, BENCH_WRITE_FRAMES);
+	}
+	pthread_join(tid, NULL);
+	cpu = cpu_seconds() - cpu;
+
+	printf("fifo_bench: chunks of %4d frames: %6.1f Mframes/s, "
+	       "queued p50 %.3f ms p99 %.3f ms p99.9 %.3f ms, %u rejects, %.2f s cpu\n",
+	       frames, audio_fifo_throughput(af) / 1e6,
+	       audio_fifo_latency_us(af, 0.5) / 1000.0, audio_fifo_latency_us(af, 0.99) / 1000.0,
+	       audio_fifo_latency_us(af, 0.999) / 1000.0, af->put_rejects, cpu);
+	free(af->pool_mem);
+	free(af);
+}
+
+int main(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(chunk_frames) / sizeof(chunk_frames[0]); i++)
+		bench(chunk_frames[i]);
+	return 0;
+}
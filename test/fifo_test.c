@@ -0,0 +1,137 @@
+/*
+ * Stress test of the audio FIFO: a producer thread queues chunks holding a
+ * running sample counter, flushing now and then the way a skip does, and
+ * the consumer checks that every sample comes out exactly once and in order,
+ * except for what a flush dropped, and that nothing queued before a flush
+ * comes out after it.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../src/audio.h"
+
+#define TEST_CHUNKS 2000000
+#define TEST_FLUSH_EVERY 9973 /* chunks */
+#define TEST_GENERATIONS (TEST_CHUNKS / TEST_FLUSH_EVERY + 2)
+
+
+static audio_fifo_t *af;
+
+/* first sample counter of each generation, written before it starts */
+static uint32_t gen_start[TEST_GENERATIONS];
+static uint32_t last_seq;
+
+
+static void *producer(void *arg)
+{
+	uint32_t seq = 0;
+	unsigned int rnd = 1;
+	audio_fifo_data_t *afd;
+	int i, j, n;
+
+	for (i = 0; i < TEST_CHUNKS; i++) {
+		if (i && i % TEST_FLUSH_EVERY == 0) {
+			gen_start[audio_fifo_generation(af) + 1] = seq;
+			audio_fifo_flush(af);
+		}
+
+		while (!(afd = audio_chunk_alloc(af)))
+			usleep(10);
+		rnd = rnd * 1103515245 + 12345;
+		n = 1 + (rnd >> 16) % (AUDIO_CHUNK_SAMPLES / 2);
+		for (j = 0; j < n; j++, seq++) {
+			afd->samples[2 * j] = seq & 0xffff;
+			afd->samples[2 * j + 1] = seq >> 16;
+		}
+		afd->nsamples = n;
+		afd->rate = 44100;
+		afd->channels = 2;
+		afd->generation = audio_fifo_generation(af);
+		while (!audio_put(af, afd))
+			usleep(10);
+	}
+	__atomic_store_n(&last_seq, seq, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static uint32_t sample_seq(audio_fifo_data_t *afd, int j)
+{
+	return (uint16_t)afd->samples[2 * j] | (uint32_t)(uint16_t)afd->samples[2 * j + 1] << 16;
+}
+
+int main(void)
+{
+	pthread_t tid;
+	audio_fifo_data_t *afd;
+	uint32_t expect = 0, end, seq;
+	unsigned int gen = 0, flushes = 0;
+	uint64_t frames = 0;
+	int j, errors = 0;
+
+	alarm(120); /* a lost wakeup or chunk hangs rather than fails */
+	if (posix_memalign((void **)&af, AUDIO_CACHELINE, sizeof(*af)))
+		return 1;
+	audio_fifo_init(af);
+	pthread_create(&tid, NULL, producer, NULL);
+
+	for (;;) {
+		end = __atomic_load_n(&last_seq, __ATOMIC_ACQUIRE);
+		afd = audio_try_get(af);
+		if (!afd) {
+			if (gen == audio_fifo_generation(af)) {
+				if (end)
+					break; /* drained */
+				usleep(1);
+				continue;
+			}
+			afd = audio_get(af); /* reports the flush */
+			if (afd) {
+				fprintf(stderr, "chunk handed out before the flush was reported\n");
+				errors++;
+				audio_chunk_free(af, afd);
+			}
+			gen = af->seen_generation;
+			flushes++;
+			if (expect > gen_start[gen]) {
+				fprintf(stderr, "generation %u starts at %u, already at %u\n",
+					gen, gen_start[gen], expect);
+				errors++;
+			}
+			expect = gen_start[gen];
+			continue;
+		}
+
+		if (afd->generation != gen) {
+			fprintf(stderr, "chunk of generation %u in generation %u\n", afd->generation, gen);
+			errors++;
+		}
+		for (j = 0; j < afd->nsamples; j++) {
+			seq = sample_seq(afd, j);
+			if (seq != expect && errors++ < 10)
+				fprintf(stderr, "sample %u where %u was expected\n", seq, expect);
+			expect = seq + 1;
+		}
+		frames += afd->nsamples;
+		audio_chunk_free(af, afd);
+		if (errors > 10)
+			break;
+	}
+	pthread_join(tid, NULL);
+
+	if (expect != __atomic_load_n(&last_seq, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "stopped at sample %u of %u\n", expect, last_seq);
+		errors++;
+	}
+	if (af->pool_avail != af->pool_chunks) {
+		fprintf(stderr, "%d chunks of %d never came back to the pool\n",
+			af->pool_chunks - af->pool_avail, af->pool_chunks);
+		errors++;
+	}
+	printf("fifo_test: %llu frames through %u flushes, %u stale chunks dropped, %s\n",
+	       (unsigned long long)frames, flushes, af->stale_chunks, errors ? "FAILED" : "ok");
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Ingestion benchmark: resolves one playlist of N synthetic tracks through
+# the fake libspotify, its metadata trickling in FAKE_SPOTIFY_LOAD_BATCH
+# tracks at a time, and reports how long it took to get them all into the
+# tracklist. Linear ingestion shows as a constant time per 1000 tracks.
+#
+# usage: test/ingest_bench.sh [binary [tracks...]], from a ./configure fake build
+
+BIN=${1:-bin/spotify_cmd}
+[ $# -gt 0 ] && shift
+SIZES=${*:-10000 100000}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for n in $SIZES ; do
+	FAKE_SPOTIFY_DELAY_MS=1 FAKE_SPOTIFY_PLAYLIST_TRACKS=$n FAKE_SPOTIFY_LOAD_BATCH=${FAKE_SPOTIFY_LOAD_BATCH:-1000} \
+		"$BIN" -a -c "$TMP/cache$n" -o null u p spotify:playlist:bench < /dev/null > /dev/null 2> "$TMP/log$n" &
+	pid=$!
+	i=0
+	while ! grep -q "^Resolved" "$TMP/log$n" && [ $i -lt 600 ] ; do
+		sleep 0.1
+		i=$((i + 1))
+	done
+	kill -INT $pid 2> /dev/null
+	wait $pid
+	ms=$(sed -n 's/^Resolved .* tracks in \([0-9.]*\) ms.*/\1/p' "$TMP/log$n")
+	if [ -z "$ms" ] ; then
+		echo "ingest $n tracks: no result" >&2
+		exit 1
+	fi
+	echo "$n $ms" | awk '{ printf "ingest %7d tracks: %9.1f ms, %6.2f ms per 1000\n", $1, $2, $2 * 1000 / $1 }'
+done
@@ -0,0 +1,152 @@
+/*
+ * Benchmark of the play queue: first checks insert, remove, move and jump
+ * at random positions against a plain array, then times each of them, and
+ * appending, on queues of 100k and 1M items.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/playqueue.h"
+
+#define MODEL_ITEMS 3000
+#define MODEL_OPS 200000
+#define BENCH_OPS 200000
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* random operations on both the queue and an array, compared as they go */
+static int model_check(void)
+{
+	static long model[MODEL_ITEMS];
+	playqueue_t q;
+	long v;
+	int n = 0, cur = 0, it, p, from, to, i;
+
+	playqueue_init(&q);
+	srand(1);
+	for (it = 0; it < MODEL_OPS; it++) {
+		switch (rand() % 5) {
+		case 0:
+		case 1:
+			if (n == MODEL_ITEMS)
+				break;
+			p = rand() % (n + 1);
+			playqueue_insert(&q, p, (void *)(long)it);
+			memmove(model + p + 1, model + p, (n - p) * sizeof(long));
+			model[p] = it;
+			if (p < cur || (p == cur && cur < n))
+				cur++;
+			n++;
+			break;
+		case 2:
+			if (!n)
+				break;
+			p = rand() % n;
+			if ((long)playqueue_remove(&q, p) != model[p]) {
+				fprintf(stderr, "remove %d: wrong item\n", p);
+				return 1;
+			}
+			memmove(model + p, model + p + 1, (n - p - 1) * sizeof(long));
+			n--;
+			if (p < cur)
+				cur--;
+			break;
+		case 3:
+			if (!n)
+				break;
+			from = rand() % n;
+			to = rand() % n;
+			playqueue_move(&q, from, to);
+			v = model[from];
+			memmove(model + from, model + from + 1, (n - from - 1) * sizeof(long));
+			memmove(model + to + 1, model + to, (n - 1 - to) * sizeof(long));
+			model[to] = v;
+			if (from == cur)
+				cur = to;
+			else if (from < cur && to >= cur)
+				cur--;
+			else if (from > cur && to <= cur)
+				cur++;
+			break;
+		default:
+			cur = rand() % (n + 1);
+			playqueue_jump(&q, cur);
+			break;
+		}
+		if (playqueue_len(&q) != n || playqueue_pos(&q) != cur) {
+			fprintf(stderr, "length %d position %d, expected %d and %d\n",
+				playqueue_len(&q), playqueue_pos(&q), n, cur);
+			return 1;
+		}
+		if (it % 1000 == 0) {
+			for (i = 0; i < n; i++) {
+				if ((long)playqueue_at(&q, i) != model[i]) {
+					fprintf(stderr, "item %d differs\n", i);
+					return 1;
+				}
+			}
+		}
+	}
+	playqueue_clear(&q, NULL);
+	return 0;
+}
+
+static void bench(int items)
+{
+	volatile void *item;
+	playqueue_t q;
+	double t;
+	int i;
+
+	playqueue_init(&q);
+	t = now();
+	for (i = 0; i < items; i++)
+		playqueue_insert(&q, playqueue_len(&q), (void *)(long)i);
+	printf("playqueue_bench: %7d items: append %6.0f ns", items, (now() - t) / items * 1e9);
+	playqueue_jump(&q, items / 2);
+
+	t = now();
+	for (i = 0; i < BENCH_OPS; i++)
+		playqueue_insert(&q, rand() % playqueue_len(&q), (void *)1L);
+	printf(", insert-at %6.0f ns", (now() - t) / BENCH_OPS * 1e9);
+
+	t = now();
+	for (i = 0; i < BENCH_OPS; i++)
+		playqueue_remove(&q, rand() % playqueue_len(&q));
+	printf(", remove %6.0f ns", (now() - t) / BENCH_OPS * 1e9);
+
+	t = now();
+	for (i = 0; i < BENCH_OPS; i++)
+		playqueue_move(&q, rand() % items, rand() % items);
+	printf(", move %6.0f ns", (now() - t) / BENCH_OPS * 1e9);
+
+	t = now();
+	for (i = 0; i < BENCH_OPS; i++) {
+		playqueue_jump(&q, rand() % items);
+		item = playqueue_current(&q);
+	}
+	printf(", jump %6.0f ns\n", (now() - t) / BENCH_OPS * 1e9);
+	(void)item;
+	playqueue_clear(&q, NULL);
+}
+
+int main(void)
+{
+	if (model_check()) {
+		printf("playqueue_bench: FAILED against the array model\n");
+		return 1;
+	}
+	bench(100000);
+	bench(1000000);
+	return 0;
+}
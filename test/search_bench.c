@@ -0,0 +1,234 @@
+/*
+ * Benchmark of the tracklist search: indexes 100k synthetic tracks, shuffles
+ * their order in a queue and removes one in seven, checks queries against a
+ * scan of every track, then times the queries both ways the player makes
+ * them: the first matches by id, for find, and the first match in tracklist
+ * order, for play, which locates the first PLAY_SCAN_MATCHES matches and
+ * walks the queue up to the best of them when there are more.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/playqueue.h"
+#include "../src/search.h"
+
+#define BENCH_TRACKS 100000
+#define BENCH_MOVES 200000
+#define BENCH_REPS 200
+#define FIELD_MAX 96
+#define PLAY_SCAN_MATCHES 64 /* as in main.c */
+
+
+static const char *words[] = {
+	"love", "lovely", "night", "dance", "dancing", "beat", "beatles",
+	"cafe", "zebra", "moon", "sun", "blue", "red", "song", "the", "of",
+	"a", "in", "heart", "fire", "rain", "x", "yesterday", "tomorrow",
+	"abbey", "road", "help", "let", "it", "be", "come", "together",
+	"something", "here", "there",
+};
+
+static const char *queries[] = {
+	"love", "lov night", "w123", "beatles abbey", "cafe road", "the",
+	"zebra moon fire", "w49999 love", "nomatch",
+};
+
+static char fields[BENCH_TRACKS][3][FIELD_MAX];
+static struct playqueue_node *nodes[BENCH_TRACKS];
+
+struct first_match {
+	search_index_t *si;
+	search_query_t query;
+	int pos;
+	int n;
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 1 to 4 words per field, a third of them out of 50k rare ones */
+static void make_tracks(void)
+{
+	char w[16];
+	int i, f, k, n;
+
+	srand(1);
+	for (i = 0; i < BENCH_TRACKS; i++) {
+		for (f = 0; f < 3; f++) {
+			n = 1 + rand() % 4;
+			fields[i][f][0] = '\0';
+			for (k = 0; k < n; k++) {
+				if (k)
+					strcat(fields[i][f], " ");
+				if (rand() % 3 == 0) {
+					snprintf(w, sizeof(w), "w%d", rand() % 50000);
+					strcat(fields[i][f], w);
+				} else {
+					strcat(fields[i][f], words[rand() % (sizeof(words) / sizeof(words[0]))]);
+				}
+			}
+		}
+	}
+}
+
+static int field_has_prefix(const char *field, const char *term, int len)
+{
+	const char *p = field;
+
+	while (*p) {
+		if (!strncmp(p, term, len))
+			return 1;
+		while (*p && *p != ' ')
+			p++;
+		while (*p == ' ')
+			p++;
+	}
+	return 0;
+}
+
+static int track_matches(int id, const char *query)
+{
+	const char *q = query, *end;
+	int f, ok;
+
+	while (*q) {
+		for (end = q; *end && *end != ' '; end++)
+			;
+		for (f = 0, ok = 0; f < 3 && !ok; f++)
+			ok = field_has_prefix(fields[id][f], q, end - q);
+		if (!ok)
+			return 0;
+		for (q = end; *q == ' '; q++)
+			;
+	}
+	return 1;
+}
+
+static int first_match_visit(void *arg, int id)
+{
+	struct first_match *first = arg;
+	int p = playqueue_node_pos(nodes[id]);
+
+	if (p < first->pos)
+		first->pos = p;
+	return first->pos == 0 || ++first->n == PLAY_SCAN_MATCHES;
+}
+
+static int first_match_item(void *arg, void *item)
+{
+	struct first_match *first = arg;
+
+	return search_query_match(first->si, &first->query, (long)item - 1);
+}
+
+/* what main.c does for play: the position of the first match, or -1 */
+static int play(search_index_t *si, playqueue_t *q, const char *query)
+{
+	struct first_match first = { si };
+	int pos;
+
+	first.pos = playqueue_len(q);
+	if (!search_query_init(si, &first.query, query)
+	    || !search_query_each(si, &first.query, first_match_visit, &first))
+		return -1;
+	if (first.n == PLAY_SCAN_MATCHES
+	    && (pos = playqueue_find(q, first.pos, first_match_item, &first)) >= 0)
+		first.pos = pos;
+	return first.pos;
+}
+
+static int check(search_index_t *si, playqueue_t *q, const char *query)
+{
+	search_query_t sq;
+	int ids[10], n, i, matching = 0, pos = -1, p;
+
+	n = search_index_find(si, query, ids, 10);
+	for (i = 0; i < n; i++) {
+		if (!nodes[ids[i]] || !track_matches(ids[i], query) || (i && ids[i - 1] >= ids[i])) {
+			fprintf(stderr, "\"%s\": track %d is not a match\n", query, ids[i]);
+			return 1;
+		}
+	}
+	for (i = 0; i < BENCH_TRACKS; i++) {
+		if (nodes[i] && track_matches(i, query)) {
+			matching++;
+			p = playqueue_node_pos(nodes[i]);
+			pos = (pos < 0 || p < pos) ? p : pos;
+		}
+		if (nodes[i] && search_query_init(si, &sq, query)
+		    && search_query_match(si, &sq, i) != track_matches(i, query)) {
+			fprintf(stderr, "\"%s\": track %d matched wrong\n", query, i);
+			return 1;
+		}
+	}
+	if (n != (matching < 10 ? matching : 10)) {
+		fprintf(stderr, "\"%s\": %d found, %d match\n", query, n, matching);
+		return 1;
+	}
+	if ((p = play(si, q, query)) != pos) {
+		fprintf(stderr, "\"%s\": first match at %d, expected %d\n", query, p, pos);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	search_index_t si;
+	playqueue_t q;
+	int ids[10], i, len, n = 0, pos = 0;
+	unsigned int k;
+	double t, t_sort;
+
+	make_tracks();
+	search_index_init(&si);
+	playqueue_init(&q);
+	t = now();
+	for (i = 0; i < BENCH_TRACKS; i++) {
+		search_index_add(&si, i, fields[i][0], fields[i][1], fields[i][2]);
+		nodes[i] = playqueue_insert(&q, i, (void *)(long)(i + 1));
+	}
+	t_sort = now();
+	search_index_sort(&si);
+	printf("search_bench: %d tracks indexed in %.1f ms, %.1f ms to sort %u words\n",
+	       BENCH_TRACKS, (t_sort - t) * 1e3, (now() - t_sort) * 1e3, si.ntokens);
+
+	/* the tracklist order drifts away from the ids */
+	len = BENCH_TRACKS;
+	for (i = 0; i < BENCH_MOVES; i++)
+		playqueue_move(&q, rand() % len, rand() % len);
+	for (i = 0; i < BENCH_TRACKS; i += 7) {
+		search_index_remove(&si, i);
+		playqueue_remove(&q, playqueue_node_pos(nodes[i]));
+		nodes[i] = NULL;
+	}
+
+	for (k = 0; k < sizeof(queries) / sizeof(queries[0]); k++) {
+		if (check(&si, &q, queries[k])) {
+			printf("search_bench: FAILED against a scan of every track\n");
+			return 1;
+		}
+
+		t = now();
+		for (i = 0; i < BENCH_REPS; i++)
+			n = search_index_find(&si, queries[k], ids, 10);
+		printf("search_bench: %-16s find %2d %8.2f us", queries[k], n,
+		       (now() - t) / BENCH_REPS * 1e6);
+
+		t = now();
+		for (i = 0; i < BENCH_REPS; i++)
+			pos = play(&si, &q, queries[k]);
+		printf(", play at %6d %8.2f us\n", pos, (now() - t) / BENCH_REPS * 1e6);
+	}
+	playqueue_clear(&q, NULL);
+	search_index_clear(&si);
+	return 0;
+}
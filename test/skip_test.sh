@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Skip latency test: plays a playlist from the fake libspotify into the null
+# sink, skips through it over the control API, and checks that the new track
+# reached the sink within SKIP_MAX_MS of every skip, as the audio thread
+# measures it.
+#
+# Track metadata takes FAKE_SPOTIFY_DELAY_MS to load, 10 ms here, standing in
+# for tracks libspotify has cached; the rest is spotify_cmd's own.
+#
+# usage: test/skip_test.sh [binary], from a ./configure fake build
+
+BIN=${1:-bin/spotify_cmd}
+PORT=${SKIP_TEST_PORT:-$((20000 + $$ % 10000))}
+SKIPS=10
+SKIP_MAX_MS=100
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+FAKE_SPOTIFY_DELAY_MS=10 "$BIN" -c "$TMP/cache" -d $PORT -o null u p spotify:playlist:skip \
+	< /dev/null > /dev/null 2> "$TMP/log" &
+pid=$!
+i=0
+while ! grep -q "^Will now begin playback" "$TMP/log" && [ $i -lt 100 ] ; do
+	sleep 0.1
+	i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $SKIPS ] ; do
+	curl -s "http://localhost:$PORT/next" > /dev/null
+	sleep 0.3
+	i=$((i + 1))
+done
+curl -s "http://localhost:$PORT/status" > "$TMP/status"
+kill -INT $pid 2> /dev/null
+wait $pid
+
+# status: <n> skips, last took <ms> ms to new audio (worst <ms> ms), ...
+set -- $(sed -n 's/^status: \([0-9]*\) skips, .*(worst \([0-9.]*\) ms).*/\1 \2/p' "$TMP/status")
+if [ "$1" != "$SKIPS" ] ; then
+	echo "skip_test: ${1:-no} skips measured out of $SKIPS, FAILED"
+	cat "$TMP/log" >&2
+	exit 1
+fi
+if ! echo "$2 $SKIP_MAX_MS" | awk '{ exit !($1 < $2) }' ; then
+	echo "skip_test: worst skip took $2 ms, over $SKIP_MAX_MS ms, FAILED"
+	exit 1
+fi
+echo "skip_test: $1 skips, worst took $2 ms to reach the sink, ok"
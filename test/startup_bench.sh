@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Startup benchmark: starts playing the same playlist twice from the fake
+# libspotify, first cold, with no stored credentials and an empty cache, then
+# warm, with the credentials blob and the uri index the first run left, and
+# prints the startup timeline (-j) of each run.
+#
+# usage: test/startup_bench.sh [binary [uri]], from a ./configure fake build
+
+BIN=$(cd "$(dirname "${1:-bin/spotify_cmd}")" && pwd)/$(basename "${1:-bin/spotify_cmd}")
+URI=${2:-spotify:playlist:startup}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# .settings, with the credentials, goes to the current directory
+cd "$TMP" || exit 1
+for run in cold warm ; do
+	"$BIN" -j -c "$TMP/cache" -o null u p "$URI" < /dev/null > "$TMP/$run.json" 2> "$TMP/$run.log" &
+	pid=$!
+	i=0
+	while [ ! -s "$TMP/$run.json" ] && [ $i -lt 300 ] ; do
+		sleep 0.1
+		i=$((i + 1))
+	done
+	kill -INT $pid 2> /dev/null
+	wait $pid
+	if [ ! -s "$TMP/$run.json" ] ; then
+		echo "startup $run: no timeline" >&2
+		cat "$TMP/$run.log" >&2
+		exit 1
+	fi
+	printf "startup %s: %s\n" $run "$(cat "$TMP/$run.json")"
+done
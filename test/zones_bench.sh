@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Zones per core: runs N zones of the fake libspotify in one process pinned
+# to a single core, each playing in real time into the null sink, and
+# reports the slowest zone's audio throughput against real time along with
+# the CPU time used. A core sustains N zones while the slowest stays at 1x.
+#
+# usage: test/zones_bench.sh [binary [zones...]], from a ./configure fake build
+
+BIN=${1:-bin/spotify_cmd}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-1 4 16 64}
+SECONDS_RUN=${ZONES_BENCH_SECONDS:-10}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for n in $COUNTS ; do
+	set -- u p spotify:playlist:zone
+	i=1
+	while [ $i -lt $n ] ; do
+		set -- "$@" -- u p spotify:playlist:zone
+		i=$((i + 1))
+	done
+	FAKE_SPOTIFY_DELAY_MS=10 taskset -c 0 "$BIN" -c "$TMP/cache$n" -o null "$@" \
+		< /dev/null > /dev/null 2> "$TMP/log$n" &
+	pid=$!
+	sleep $SECONDS_RUN
+	kill -INT $pid 2> /dev/null
+	wait $pid
+
+	# [zone <i>: ]status: pipeline <n> frames/s, ..., and the process wide
+	# [zone <i>: ]status: cpu <s> s user, <s> s system; the last of each counts
+	awk -v n=$n -v t=$SECONDS_RUN '
+		/status: pipeline / {
+			zone = $1 == "zone" ? $2 : "0:"
+			for (i = 1; i < NF; i++)
+				if ($(i + 1) == "frames/s,")
+					rate[zone] = $i
+		}
+		/status: cpu / {
+			cpu = 0
+			for (i = 1; i < NF; i++)
+				if ($(i + 1) == "s")
+					cpu += $i
+		}
+		END {
+			zones = 0
+			for (zone in rate)
+				if (!zones++ || rate[zone] < slowest)
+					slowest = rate[zone]
+			if (zones != n) {
+				printf "zones %3d on one core: %d zones reported, FAILED\n", n, zones
+				exit 1
+			}
+			printf "zones %3d on one core: slowest at %.3fx real time, %.1f%% of the core\n",
+			       n, slowest / 44100, 100 * cpu / t
+		}' "$TMP/log$n" || exit 1
+done